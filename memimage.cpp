@@ -6,6 +6,7 @@ extern "C" {
 #include "wave_reader.h" 
 }
 #include "./wav12/compress.h"
+#include "./wav12/resample.h"
 
 MemImageUtil::MemImageUtil()
 {
@@ -86,14 +87,33 @@ public:
         m_size(memSize)
     {}
 
-    virtual void fillSubBuffer() {
+    virtual bool seek(uint32_t pos) {
+        assert(pos <= m_size);
+        m_pos = pos;
+        emptySubBuffer();
+        return true;
+    }
+
+    virtual int fillSubBuffer() {
         assert((m_pos & 1) == 0);
         int toRead = wav12::wMin(int(m_size - m_pos), m_subBufferSize);
         assert(m_pos + toRead <= m_size);
         memcpy(m_subBuffer, m_mem + m_pos, toRead);
-        m_subBufferPos = 0;
         m_pos += toRead;
         assert(m_pos <= m_size);
+        return toRead;
+    }
+
+    // Drain the sub-buffer, then copy straight from memory.
+    virtual int read(uint8_t* dst, int n) {
+        int nRead = wav12::wMin(n, m_subBufferLen - m_subBufferPos);
+        memcpy(dst, m_subBuffer + m_subBufferPos, nRead);
+        m_subBufferPos += nRead;
+
+        int toRead = wav12::wMin(int(m_size - m_pos), n - nRead);
+        memcpy(dst + nRead, m_mem + m_pos, toRead);
+        m_pos += toRead;
+        return nRead + toRead;
     }
 
 private:
@@ -102,12 +122,14 @@ private:
     uint32_t m_size;
 };
 
-void MemImageUtil::dumpConsole()
+void MemImageUtil::dumpConsole(bool dither)
 {
     uint32_t totalUncompressed = 0, totalSize = 0;
     const MemImage* image = (const MemImage*)dataVec;
     static const int SUB_BUFFER_SIZE = 64;
     uint8_t subBuffer[SUB_BUFFER_SIZE];
+    // The source samples of each file, reused from file to file.
+    std::vector<int16_t> wavBuffer, resampledBuffer;
 
     for (int d = 0; d < MemImage::NUM_DIR; ++d) {
         uint32_t dirTotal = 0;
@@ -131,15 +153,19 @@ void MemImageUtil::dumpConsole()
                     std::string path = std::string(dirName) 
                         + "/" + std::string(fileName) + std::string(".wav");
 
-                    int16_t* wav = 0;
+                    const int16_t* wav = 0;
                     int nSamples = 0;
+                    int rate = 0;
+                    const int channels = header->channels();
                     {
                         wave_reader_error error = WR_NO_ERROR;
                         wave_reader* wr = wave_reader_open(path.c_str(), &error);
                         assert(error == WR_NO_ERROR);
                         nSamples = wave_reader_get_num_samples(wr);
-                        wav = new int16_t[nSamples];
-                        wave_reader_get_samples(wr, nSamples, wav);
+                        rate = wave_reader_get_sample_rate(wr);
+                        wavBuffer.resize(wav12::wMax(size_t(nSamples * channels), size_t(1)));
+                        wave_reader_get_samples_int16(wr, nSamples, &wavBuffer[0], dither);
+                        wav = &wavBuffer[0];
                         wave_reader_close(wr);
                     }
 
@@ -148,43 +174,52 @@ void MemImageUtil::dumpConsole()
                         fileUnit.size,
                         subBuffer, SUB_BUFFER_SIZE);
 
+                    wav12::Expander expander(&fcs, *header);
+                    if (int(expander.rate()) != rate) {
+                        // Compare to the input as it was resampled.
+                        wav12::Resampler resampler(rate, expander.rate(), channels);
+                        int nResampled = resampler.outputFrames(nSamples);
+                        resampledBuffer.resize(wav12::wMax(size_t(nResampled * channels), size_t(1)));
+                        resampler.process(wav, nSamples, &resampledBuffer[0]);
+                        wav = &resampledBuffer[0];
+                        nSamples = nResampled;
+                    }
+
                     assert(fileUnit.size == header->lenInBytes + sizeof(wav12::Wav12Header));
                     assert(nSamples == header->nSamples);
                     
                     wav12::MemStream memStream(
                         dataVec + fileUnit.offset + sizeof(wav12::Wav12Header),
                         fileUnit.size);
-                    
-                    wav12::Expander expander(&fcs, header->nSamples, header->format, header->shiftBits);
+
                     int errorRange = 1 << header->shiftBits;
 
                     static const int BUFSIZE = 256;
                     int16_t buf[BUFSIZE];
 
-                    for (int i = 0; i < nSamples; i += BUFSIZE) {
-                        int n = wav12::wMin(BUFSIZE, nSamples - i);
+                    for (int i = 0; i < nSamples; i += BUFSIZE / channels) {
+                        int n = wav12::wMin(BUFSIZE / channels, nSamples - i);
                         expander.expand(buf, n);
 
-                        for (int j = 0; j < n; ++j) {
-                            if (abs(buf[j] - wav[i + j]) >= errorRange) {
+                        for (int j = 0; j < n * channels; ++j) {
+                            if (abs(buf[j] - wav[i * channels + j]) >= errorRange) {
                                 assert(false);
                                 okay = false;
                             }
                         }
                     }
 
-                    delete[] wav;
                 }
 
                 printf("   %8s at %8d size=%6d (%3dk) comp=%d ratio=%4.2f shift=%d valid=%s\n", 
                     fileName, 
                     fileUnit.offset, fileUnit.size, fileUnit.size / 1024,
                     header->format,
-                    float(header->lenInBytes) / (float)(header->nSamples*2),
+                    float(header->lenInBytes) / (float)(header->nSamples * 2 * header->channels()),
                     header->shiftBits,
                     okay ? "true" : "ERROR" );
 
-                totalUncompressed += header->nSamples * 2;
+                totalUncompressed += header->nSamples * 2 * header->channels();
                 totalSize += header->lenInBytes;
                 dirTotal += header->lenInBytes;
             }
@@ -42,7 +42,8 @@ public:
 
     void addDir(const char* name);
     void addFile(const char* name, void* data, int size);
-    void dumpConsole();
+    // Verifies the image against the wav files, read with the same dither.
+    void dumpConsole(bool dither = false);
 
     void write(const char* name);
     void writeText(const char* name);
@@ -1,5 +1,10 @@
 #include "bits.h"
 
+#include <string.h>
+#if defined(_MSC_VER)
+#include <stdlib.h>
+#endif
+
 void BitAccum::push(uint32_t v, int nBits) {
     assert(nUsed + nBits <= 32);
     assert(nBits == 32 || (v < (1U << nBits)));
@@ -24,72 +29,114 @@ uint32_t BitAccum::pop(int nBits) {
 }
 
 
-void BitWriter::write(uint32_t value, int nBits) {
-    assert(nBits == 32 || (value < (1U << nBits)));
-    while (nBits) {
-        if (accum.bitsUsed() == 8) {
-            *target = uint8_t(accum.get());
-            target++;
-            assert(target < start + size);
-            accum.clear();
-        }
-        int avail = 8 - accum.bitsUsed();
-        if (avail >= nBits) {
-            accum.push(value, nBits);
-            nBits = 0;
-        }
-        else {
-            int n = (nBits - avail);
-            uint32_t high = value >> n;
-            accum.push(high, avail);
-            nBits -= avail;
-            value &= ((1 << nBits) - 1);
+static inline void storeBE32(uint8_t* p, uint32_t v)
+{
+#if defined(_MSC_VER)
+    v = _byteswap_ulong(v);
+#else
+    v = __builtin_bswap32(v);
+#endif
+    memcpy(p, &v, 4);
+}
+
+
+// Stores the oldest 32 pending bits as a word. There is one bounds
+// check per word; only the last bytes of a fixed buffer go one by one.
+void BitWriter::store()
+{
+    nPending -= 32;
+    const uint32_t word = uint32_t(bits >> nPending);
+    if (sink && end - target < 4)
+        flush();
+    if (end - target >= 4) {
+        storeBE32(target, word);
+        target += 4;
+    }
+    else {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            assert(target < end);
+            *target++ = uint8_t(word >> shift);
         }
     }
 }
 
 void BitWriter::close() 
 {
-    if (!accum.empty()) {
-        accum.push(0, 8 - accum.bitsUsed());
-        *target = uint8_t(accum.get());
+    // The last partial byte is padded with 0.
+    for (; nPending > 0; nPending -= 8) {
+        uint8_t b = nPending >= 8 ? uint8_t(bits >> (nPending - 8)) : uint8_t(bits << (8 - nPending));
+        if (sink && target == end)
+            flush();
+        assert(target < end);
+        *target++ = b;
     }
+    nPending = 0;
+    if (sink)
+        flush();
 }
 
+void BitWriter::flush()
+{
+    sink->write(start, int(target - start));
+    flushed += int(target - start);
+    target = start;
+}
 
-uint32_t BitReader::read(int nBits) {
-    assert(nBits <= 32);
-    uint32_t result = 0;
 
-    while (nBits) {
-        if (accum.bitsUsed() == 0) {
-            assert(accum.empty());
-            accum.clear();
+static inline uint64_t loadBE64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if defined(_MSC_VER)
+    return _byteswap_uint64(v);
+#else
+    return __builtin_bswap64(v);
+#endif
+}
 
-            uint8_t val = 0;
-            if (stream) {
-                val = stream->get();
-            }
-            else {
-                assert(src < start + nBytes);
-                val = *src;
-                ++src;
-            }
-            accum.set(val, 8);
-        }
-        if (nBits <= accum.bitsUsed()) {
-            result <<= nBits;
-            result |= accum.pop(nBits);
-            nBits = 0;
+
+void BitReader::refill(int nBits)
+{
+    if (stream) {
+        // With a limit, fill the word (as from memory) up to the end
+        // of the data. Without one, only pull the bytes asked for, so
+        // the stream is never advanced past the data.
+        uint8_t buf[8] = { 0 };
+        int need = (nBits - nAvail + 7) >> 3;
+        int want = need;
+        if (nStreamLimit != NO_LIMIT) {
+            uint32_t left = nStreamLimit - nStreamBytes;
+            want = (63 - nAvail) >> 3;
+            if (uint32_t(want) > left)
+                want = int(left);
         }
-        else {
-            int n = accum.bitsUsed();
-            result <<= n;
-            result |= accum.pop(n);
-            nBits -= n;
+        int n = want ? stream->read(buf, want) : 0;
+        nStreamBytes += n;
+        bits |= loadBE64(buf) >> nAvail;
+        nAvail += n * 8;
+        // At the end, everything after is 0 bits.
+        if (n < need || n < want)
+            nAvail = 64;
+        return;
+    }
+
+    const uint8_t* end = start + nBytes;
+    if (end - src >= 8) {
+        // Load a whole word, and keep as many whole bytes as fit.
+        bits |= loadBE64(src) >> nAvail;
+        int n = (63 - nAvail) >> 3;
+        src += n;
+        nAvail += n * 8;
+    }
+    else {
+        while (nAvail <= 56 && src < end) {
+            bits |= uint64_t(*src) << (56 - nAvail);
+            ++src;
+            nAvail += 8;
         }
+        if (src == end)
+            nAvail = 64;
     }
-    return result;
 }
 
 
@@ -160,6 +207,59 @@ uint32_t BitReader::read(int nBits) {
         uint32_t v = reader.read(5 + i % 3);
         TEST_TRUE(v == i);
     }
+
+    BitReader peeker(store, NUM_CLEAR);
+    for (uint32_t i = 0; i < NUM_CLEAR; i += 2) {
+        int n0 = 5 + i % 3;
+        int n1 = 5 + (i + 1) % 3;
+        uint32_t v = peeker.peek(n0 + n1);
+        TEST_TRUE((v >> n1) == i);
+        TEST_TRUE((v & ((1 << n1) - 1)) == i + 1);
+        peeker.consume(n0 + n1);
+    }
+
+    {
+        // Every width, to a buffer that isn't a whole number of words,
+        // and through a sink with a small buffer. Both match a bit at a
+        // time reference.
+        struct ByteSink : public wav12::IOutStream {
+            uint8_t data[256];
+            int n = 0;
+            virtual void write(const uint8_t* src, int len) {
+                memcpy(data + n, src, len);
+                n += len;
+            }
+        };
+        static const int SIZE = 67;
+        uint8_t ref[SIZE] = { 0 };
+        uint8_t out[SIZE] = { 0 };
+        uint8_t buf[6];
+        ByteSink sink;
+        BitWriter fixed(out, SIZE);
+        BitWriter streamed(buf, 6, &sink);
+        uint32_t seed = 1;
+        int nBits = 0;
+        // 528 bits, then 3 more, to end on a partial byte.
+        for (int i = 0; i <= 33; ++i) {
+            int width = i == 33 ? 3 : i;
+            seed = seed * 1664525 + 1013904223;
+            uint32_t v = width == 32 ? seed : seed & ((1U << width) - 1);
+            fixed.write(v, width);
+            streamed.write(v, width);
+            for (int b = width - 1; b >= 0; --b, ++nBits)
+                ref[nBits / 8] |= ((v >> b) & 1) << (7 - nBits % 8);
+            TEST_TRUE(fixed.bitPosition() == uint32_t(nBits));
+            TEST_TRUE(streamed.bitPosition() == uint32_t(nBits));
+        }
+        TEST_TRUE(fixed.length() == SIZE);
+        fixed.close();
+        streamed.close();
+        TEST_TRUE(fixed.length() == SIZE);
+        TEST_TRUE(streamed.length() == SIZE);
+        TEST_TRUE(sink.n == SIZE);
+        TEST_TRUE(memcmp(out, ref, SIZE) == 0);
+        TEST_TRUE(memcmp(sink.data, ref, SIZE) == 0);
+    }
     return true;
 }
 
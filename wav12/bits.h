@@ -5,6 +5,9 @@
 
 #include <stdint.h>
 #include <assert.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 class BitAccum
 {
@@ -21,12 +24,19 @@ public:
     void push(uint32_t v, int nBits);
     uint32_t pop(int nBits);
 
+    // Number of leading 0 bits; 32 for 0.
+    static int leadingZeros(uint32_t v) {
+#if defined(_MSC_VER)
+        unsigned long index;
+        return _BitScanReverse(&index, v) ? 31 - int(index) : 32;
+#else
+        return v ? __builtin_clz(v) : 32;
+#endif
+    }
+
+    // Bits to hold v; 0 needs 1.
     static int bitsNeeded(uint32_t v) {
-        for (int i = 1; i < 32; ++i) {
-            if ((1U << i) > v)
-                return i;
-        }
-        return 32;
+        return v ? 32 - leadingZeros(v) : 1;
     }
 
     static bool Test();
@@ -42,19 +52,43 @@ public:
     BitWriter(uint8_t* data, int n) {
         this->target = data;
         this->start = data;
-        this->size = n;
+        this->end = data + n;
+    }
+
+    // 'data' is a buffer that is written to 'sink' whenever it fills,
+    // and on close(); the output can be any length.
+    BitWriter(uint8_t* data, int n, wav12::IOutStream* sink) : BitWriter(data, n) {
+        this->sink = sink;
+    }
+
+    // Writes nBits [0, 32] of value, high bit first.
+    void write(uint32_t value, int nBits) {
+        assert(nBits >= 0 && nBits <= 32);
+        assert(nBits == 32 || (value < (1U << nBits)));
+        bits = (bits << nBits) | value;
+        nPending += nBits;
+        if (nPending >= 32)
+            store();
     }
 
-    void write(uint32_t value, int nBits);
     void close();
-    int length() const { return int(target - start + (accum.empty() ? 0 : 1)); }
+    int length() const { return flushed + int(target - start) + (nPending + 7) / 8; }
+    uint32_t bitPosition() const { return uint32_t(flushed + (target - start)) * 8 + nPending; }
 
 private:
-    const uint8_t* start = 0;
+    uint8_t* start = 0;
     uint8_t* target = 0;
-    int size = 0;
+    uint8_t* end = 0;
+    wav12::IOutStream* sink = 0;
+    int flushed = 0;            // bytes written to the sink
+
+    // Bits not yet stored are the low nPending [0, 31] bits; above
+    // them is stale data.
+    uint64_t bits = 0;
+    int nPending = 0;
 
-    BitAccum accum;
+    void store();
+    void flush();
 };
 
 class BitReader
@@ -75,30 +109,76 @@ public:
     }
 
     BitReader(wav12::IStream* stream) {
-        this->src = 0;
-        this->start = 0;
-        this->nBytes = 0;
-        this->stream = stream;
+        init(stream);
     }
 
-    void init(wav12::IStream* stream) {
-        this->src = 0;
-        this->start = 0;
-        this->nBytes = 0;
-        this->stream = stream;
-        this->accum.clear();
+    static const uint32_t NO_LIMIT = 0xffffffff;
+
+    // Memory backed streams are read in place, from their window().
+    // At most 'limit' bytes are read, which is where the data ends.
+    void init(wav12::IStream* stream, uint32_t limit = NO_LIMIT) {
+        uint32_t n = 0;
+        const uint8_t* window = stream ? stream->window(&n) : 0;
+        this->src = window;
+        this->start = window;
+        this->nBytes = int(n < limit ? n : limit);
+        this->stream = window ? 0 : stream;
+        this->bits = 0;
+        this->nAvail = 0;
+        this->nStreamBytes = 0;
+        this->nStreamLimit = limit;
+    }
+
+    // Returns the next nBits [1, 32] without consuming them.
+    // Bits past the end of the data read as 0, so a stream that ends
+    // early can't read out of bounds; that's checked in refill(), not
+    // per read. CHECKED is for debugging: it asserts the arguments of
+    // every call. The decoder's fast path doesn't.
+    template<bool CHECKED = true>
+    uint32_t peek(int nBits) {
+        if (CHECKED)
+            assert(nBits > 0 && nBits <= 32);
+        if (nAvail < nBits)
+            refill(nBits);
+        return uint32_t(bits >> (64 - nBits));
     }
 
-    uint32_t read(int nBits);
+    template<bool CHECKED = true>
+    void consume(int nBits) {
+        if (CHECKED)
+            assert(nBits <= nAvail);
+        bits <<= nBits;
+        nAvail -= nBits;
+    }
+
+    template<bool CHECKED = true>
+    uint32_t read(int nBits) {
+        uint32_t result = peek<CHECKED>(nBits);
+        consume<CHECKED>(nBits);
+        return result;
+    }
+
+    // The bytes taken from the stream since init(); 0 if it's read in
+    // place. A copy of the reader carries on from where it was, once
+    // the stream is back there.
+    uint32_t streamBytes() const { return nStreamBytes; }
 
     static bool TestReaderAndWriter();
 
 private:
+    void refill(int nBits);
+
     const uint8_t* src = 0;
-    const uint8_t* start = 0;       // only used for error checking.
-    int nBytes = 0;                 // only used for error checking.
+    const uint8_t* start = 0;
+    int nBytes = 0;
     wav12::IStream* stream = 0;
-    BitAccum accum;
+    uint32_t nStreamBytes = 0;
+    uint32_t nStreamLimit = NO_LIMIT;
+
+    // The next bit to read is the high bit. Bits below nAvail are
+    // either 0 or the (correct) bits that follow in the data.
+    uint64_t bits = 0;
+    int nAvail = 0;
 };
 
 
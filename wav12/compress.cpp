@@ -5,94 +5,1161 @@
 #include <limits.h>
 #include "bits.h"
 
+// The encoder's analysis pass (residuals and their sizes) is vectorized
+// where the target has it; everything else is scalar.
+#if defined(__AVX2__)
+#define WAV12_ENCODE_AVX2
+#define WAV12_ENCODE_SSE2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WAV12_ENCODE_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define WAV12_ENCODE_NEON
+#include <arm_neon.h>
+#endif
+
 using namespace wav12;
 
+// The fixed polynomial predictors, as in Shorten and FLAC. Order 3 is
+// used unless the stream has FLAG_PREDICTOR.
+template<int ORDER>
+static inline int32_t predict(int32_t prev1, int32_t prev2, int32_t prev3)
+{
+    switch (ORDER) {
+    case 0: return 0;
+    case 1: return prev1;
+    case 2: return 2 * prev1 - prev2;
+    default: return 3 * prev1 - 3 * prev2 + prev3;
+    }
+}
+
+static int32_t predict(int order, int32_t prev1, int32_t prev2, int32_t prev3)
+{
+    switch (order) {
+    case 0: return predict<0>(prev1, prev2, prev3);
+    case 1: return predict<1>(prev1, prev2, prev3);
+    case 2: return predict<2>(prev1, prev2, prev3);
+    default: return predict<3>(prev1, prev2, prev3);
+    }
+}
+
+// Bits to write 'delta' in the linear format.
+static inline int linearCost(int32_t delta)
+{
+    int bits = BitAccum::bitsNeeded(delta < 0 ? -delta : delta);
+    return bits > 15 ? 4 + 16 : 5 + bits;
+}
+
+// In format 1 a residual of "-0" is never written, so that code (6 zero
+// bits) escapes a run of zero residuals. The run length, less MIN_RUN, follows
+// as a 4 bit length and magnitude. Runs don't cross blocks.
+static const int RUN_ESCAPE_BITS = 6;
+static const int MIN_RUN = 8;
+static const int MAX_RUN = MIN_RUN + 0xffff;
+
+// The Rice format codes a zero run of (u >> k), a 1, then the low k bits
+// of u. Runs of RICE_ESCAPE zeros are followed by a raw 16 bit sample.
+static const int RICE_ESCAPE = 16;
+static const int MAX_RICE_PARAM = 15;
+
+// Residuals wrap at 16 bits, the same as the decoder, so they always fit.
+static inline int32_t riceDelta(int32_t sample, int32_t guess)
+{
+    return int16_t(sample - guess);
+}
+
+// Signed to unsigned: 0, -1, 1, -2, 2... map to 0, 1, 2, 3, 4...
+static inline uint32_t zigZag(int32_t v)
+{
+    return (uint32_t(v) << 1) ^ uint32_t(v >> 31);
+}
+
+static inline int riceCost(uint32_t u, int k)
+{
+    uint32_t q = u >> k;
+    return q >= uint32_t(RICE_ESCAPE) ? RICE_ESCAPE + 16 : int(q) + 1 + k;
+}
+
+// Samples before the ones being coded.
+struct History
+{
+    int32_t prev1 = 0;
+    int32_t prev2 = 0;
+    int32_t prev3 = 0;
+
+    void push(int32_t sample) {
+        prev3 = prev2;
+        prev2 = prev1;
+        prev1 = sample;
+    }
+};
+
+// The analysis pass. Residuals are at most about 20 bits (16 bit samples,
+// and the order 3 predictor), so their sizes come from the exponent of
+// a float conversion where there is no vector count-leading-zeros.
+
+template<int ORDER>
+static void residuals(const int32_t* data, int n, History h, int32_t* out)
+{
+    int i = 0;
+    // The first 3 predict from the history.
+    for (; i < n && i < 3; ++i) {
+        out[i] = data[i] - predict<ORDER>(h.prev1, h.prev2, h.prev3);
+        h.push(data[i]);
+    }
+#if defined(WAV12_ENCODE_AVX2)
+    for (; i + 8 <= n; i += 8) {
+        __m256i p1 = _mm256_loadu_si256((const __m256i*)(data + i - 1));
+        __m256i p2 = _mm256_loadu_si256((const __m256i*)(data + i - 2));
+        __m256i p3 = _mm256_loadu_si256((const __m256i*)(data + i - 3));
+        __m256i guess = _mm256_setzero_si256();
+        if (ORDER == 1) {
+            guess = p1;
+        }
+        else if (ORDER == 2) {
+            guess = _mm256_sub_epi32(_mm256_add_epi32(p1, p1), p2);
+        }
+        else if (ORDER == 3) {
+            __m256i d = _mm256_sub_epi32(p1, p2);
+            guess = _mm256_add_epi32(_mm256_add_epi32(d, d), _mm256_add_epi32(d, p3));
+        }
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_sub_epi32(v, guess));
+    }
+#endif
+#if defined(WAV12_ENCODE_SSE2)
+    for (; i + 4 <= n; i += 4) {
+        __m128i p1 = _mm_loadu_si128((const __m128i*)(data + i - 1));
+        __m128i p2 = _mm_loadu_si128((const __m128i*)(data + i - 2));
+        __m128i p3 = _mm_loadu_si128((const __m128i*)(data + i - 3));
+        __m128i guess = _mm_setzero_si128();
+        if (ORDER == 1) {
+            guess = p1;
+        }
+        else if (ORDER == 2) {
+            guess = _mm_sub_epi32(_mm_add_epi32(p1, p1), p2);
+        }
+        else if (ORDER == 3) {
+            __m128i d = _mm_sub_epi32(p1, p2);
+            guess = _mm_add_epi32(_mm_add_epi32(d, d), _mm_add_epi32(d, p3));
+        }
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi32(v, guess));
+    }
+#elif defined(WAV12_ENCODE_NEON)
+    for (; i + 4 <= n; i += 4) {
+        int32x4_t p1 = vld1q_s32(data + i - 1);
+        int32x4_t p2 = vld1q_s32(data + i - 2);
+        int32x4_t p3 = vld1q_s32(data + i - 3);
+        int32x4_t guess = vdupq_n_s32(0);
+        if (ORDER == 1)
+            guess = p1;
+        else if (ORDER == 2)
+            guess = vsubq_s32(vaddq_s32(p1, p1), p2);
+        else if (ORDER == 3)
+            guess = vmlaq_n_s32(p3, vsubq_s32(p1, p2), 3);
+        vst1q_s32(out + i, vsubq_s32(vld1q_s32(data + i), guess));
+    }
+#endif
+    for (; i < n; ++i)
+        out[i] = data[i] - predict<ORDER>(data[i - 1], data[i - 2], data[i - 3]);
+}
+
+// Residuals of 'n' samples with the predictor of 'order'.
+static void residuals(const int32_t* data, int n, const History& h, int order, int32_t* out)
+{
+    switch (order) {
+    case 0: residuals<0>(data, n, h, out); break;
+    case 1: residuals<1>(data, n, h, out); break;
+    case 2: residuals<2>(data, n, h, out); break;
+    default: residuals<3>(data, n, h, out); break;
+    }
+}
+
+#if defined(WAV12_ENCODE_AVX2)
+// BitAccum::bitsNeeded(abs(d)) of each lane.
+static inline __m256i bitsNeeded8(__m256i d)
+{
+    __m256i a = _mm256_or_si256(_mm256_abs_epi32(d), _mm256_set1_epi32(1));
+    __m256i e = _mm256_srli_epi32(_mm256_castps_si256(_mm256_cvtepi32_ps(a)), 23);
+    return _mm256_sub_epi32(e, _mm256_set1_epi32(126));
+}
+#endif
+#if defined(WAV12_ENCODE_SSE2)
+static inline __m128i bitsNeeded4(__m128i d)
+{
+    __m128i sign = _mm_srai_epi32(d, 31);
+    __m128i a = _mm_sub_epi32(_mm_xor_si128(d, sign), sign);
+    a = _mm_or_si128(a, _mm_set1_epi32(1));
+    __m128i e = _mm_srli_epi32(_mm_castps_si128(_mm_cvtepi32_ps(a)), 23);
+    return _mm_sub_epi32(e, _mm_set1_epi32(126));
+}
+#elif defined(WAV12_ENCODE_NEON)
+static inline int32x4_t bitsNeeded4(int32x4_t d)
+{
+    int32x4_t a = vorrq_s32(vabsq_s32(d), vdupq_n_s32(1));
+    return vsubq_s32(vdupq_n_s32(32), vclzq_s32(a));
+}
+#endif
+
+// BitAccum::bitsNeeded() of the magnitude of each residual.
+static void residualBits(const int32_t* resid, int n, uint8_t* bits)
+{
+    int i = 0;
+#if defined(WAV12_ENCODE_AVX2)
+    for (; i + 16 <= n; i += 16) {
+        __m256i b0 = bitsNeeded8(_mm256_loadu_si256((const __m256i*)(resid + i)));
+        __m256i b1 = bitsNeeded8(_mm256_loadu_si256((const __m256i*)(resid + i + 8)));
+        // Packs work within 128 bit lanes; put them back in order.
+        __m256i b16 = _mm256_permute4x64_epi64(_mm256_packs_epi32(b0, b1), 0xd8);
+        __m128i b8 = _mm_packus_epi16(_mm256_castsi256_si128(b16), _mm256_extracti128_si256(b16, 1));
+        _mm_storeu_si128((__m128i*)(bits + i), b8);
+    }
+#endif
+#if defined(WAV12_ENCODE_SSE2)
+    for (; i + 8 <= n; i += 8) {
+        __m128i b0 = bitsNeeded4(_mm_loadu_si128((const __m128i*)(resid + i)));
+        __m128i b1 = bitsNeeded4(_mm_loadu_si128((const __m128i*)(resid + i + 4)));
+        __m128i b8 = _mm_packus_epi16(_mm_packs_epi32(b0, b1), _mm_setzero_si128());
+        _mm_storel_epi64((__m128i*)(bits + i), b8);
+    }
+#elif defined(WAV12_ENCODE_NEON)
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t b16 = vcombine_s16(vmovn_s32(bitsNeeded4(vld1q_s32(resid + i))),
+            vmovn_s32(bitsNeeded4(vld1q_s32(resid + i + 4))));
+        vst1_u8(bits + i, vmovn_u16(vreinterpretq_u16_s16(b16)));
+    }
+#endif
+    for (; i < n; ++i) {
+        int32_t d = resid[i];
+        bits[i] = uint8_t(BitAccum::bitsNeeded(d < 0 ? -d : d));
+    }
+}
+
+// Sum of linearCost() over the residuals.
+static int64_t linearCostSum(const int32_t* resid, int n)
+{
+    int64_t sum = 0;
+    int i = 0;
+#if defined(WAV12_ENCODE_SSE2)
+    // linearCost is min(5 + bits, 20): at most 20 per lane per step, so
+    // the lanes can't overflow within a block of any size.
+    const __m128i five = _mm_set1_epi32(5);
+    const __m128i twenty = _mm_set1_epi32(20);
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        __m128i cost = _mm_add_epi32(bitsNeeded4(_mm_loadu_si128((const __m128i*)(resid + i))), five);
+        // The high halves are 0, so a 16 bit min is a 32 bit min.
+        acc = _mm_add_epi32(acc, _mm_min_epi16(cost, twenty));
+    }
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    sum = int64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+#elif defined(WAV12_ENCODE_NEON)
+    const int32x4_t five = vdupq_n_s32(5);
+    const int32x4_t twenty = vdupq_n_s32(20);
+    int32x4_t acc = vdupq_n_s32(0);
+    for (; i + 4 <= n; i += 4)
+        acc = vaddq_s32(acc, vminq_s32(vaddq_s32(bitsNeeded4(vld1q_s32(resid + i)), five), twenty));
+    sum = int64_t(vgetq_lane_s32(acc, 0)) + vgetq_lane_s32(acc, 1) + vgetq_lane_s32(acc, 2) + vgetq_lane_s32(acc, 3);
+#endif
+    for (; i < n; ++i)
+        sum += linearCost(resid[i]);
+    return sum;
+}
+
+// Sum of the Rice residuals (zigZag(riceDelta())), which stands in for
+// their size.
+static int64_t riceSum(const int32_t* resid, int n)
+{
+    int64_t sum = 0;
+    int i = 0;
+#if defined(WAV12_ENCODE_SSE2)
+    // Each value is 16 bits; the lanes are drained before they can overflow.
+    static const int DRAIN = 1 << 14;
+    while (i + 4 <= n) {
+        __m128i acc = _mm_setzero_si128();
+        for (int end = wMin(n & ~3, i + DRAIN * 4); i < end; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(resid + i));
+            v = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+            v = _mm_xor_si128(_mm_slli_epi32(v, 1), _mm_srai_epi32(v, 31));
+            acc = _mm_add_epi32(acc, v);
+        }
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i*)lanes, acc);
+        sum += int64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    }
+#elif defined(WAV12_ENCODE_NEON)
+    static const int DRAIN = 1 << 14;
+    while (i + 4 <= n) {
+        uint32x4_t acc = vdupq_n_u32(0);
+        for (int end = wMin(n & ~3, i + DRAIN * 4); i < end; i += 4) {
+            int32x4_t v = vshrq_n_s32(vshlq_n_s32(vld1q_s32(resid + i), 16), 16);
+            v = veorq_s32(vshlq_n_s32(v, 1), vshrq_n_s32(v, 31));
+            acc = vaddq_u32(acc, vreinterpretq_u32_s32(v));
+        }
+        sum += int64_t(vgetq_lane_u32(acc, 0)) + vgetq_lane_u32(acc, 1) + vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+    }
+#endif
+    for (; i < n; ++i)
+        sum += zigZag(int16_t(resid[i]));
+    return sum;
+}
+
+// Left and right to the coded pair of a Wav12Header::STEREO_* mode, and back.
+static inline void toCoded(int mode, int32_t left, int32_t right, int32_t* c0, int32_t* c1)
+{
+    switch (mode) {
+    case Wav12Header::STEREO_LR: *c0 = left; *c1 = right; break;
+    case Wav12Header::STEREO_LS: *c0 = left; *c1 = left - right; break;
+    case Wav12Header::STEREO_SR: *c0 = left - right; *c1 = right; break;
+    default: *c0 = (left + right) >> 1; *c1 = left - right; break;
+    }
+}
+
+static inline void fromCoded(int mode, int32_t c0, int32_t c1, int32_t* left, int32_t* right)
+{
+    switch (mode) {
+    case Wav12Header::STEREO_LR: *left = c0; *right = c1; break;
+    case Wav12Header::STEREO_LS: *left = c0; *right = c0 - c1; break;
+    case Wav12Header::STEREO_SR: *left = c1 + c0; *right = c1; break;
+    default: {
+        // The bit lost from the mid is the low bit of the side.
+        int32_t sum = c0 * 2 + (c1 & 1);
+        *left = (sum + c1) >> 1;
+        *right = (sum - c1) >> 1;
+        break;
+    }
+    }
+}
+
+// Bits for the next 'n' samples with each predictor.
+// For Rice, the sum of the residuals stands in for the size.
+// 'scratch' has room for n residuals.
+static void predictorCosts(int format, const int32_t* data, int n, const History& h,
+    int32_t* scratch, int64_t* cost)
+{
+    for (int order = 0; order < Wav12Header::NUM_PREDICTORS; ++order) {
+        residuals(data, n, h, order, scratch);
+        if (format == Wav12Header::FORMAT_RICE)
+            cost[order] = riceSum(scratch, n);
+        else
+            cost[order] = linearCostSum(scratch, n);
+    }
+}
+
+// Picks the predictor that codes the next 'n' samples in the fewest bits.
+static int choosePredictor(int format, const int32_t* data, int n, const History& h,
+    int32_t* scratch)
+{
+    int64_t cost[Wav12Header::NUM_PREDICTORS];
+    predictorCosts(format, data, n, h, scratch, cost);
+    int best = Wav12Header::NUM_PREDICTORS - 1;
+    for (int order = 0; order < Wav12Header::NUM_PREDICTORS; ++order) {
+        if (cost[order] < cost[best])
+            best = order;
+    }
+    return best;
+}
+
+// Picks the Rice parameter that codes 'n' residuals in the fewest bits.
+static int chooseRiceParam(const int32_t* resid, int n)
+{
+    int64_t cost[MAX_RICE_PARAM + 1] = { 0 };
+    for (int i = 0; i < n; ++i) {
+        uint32_t u = zigZag(riceDelta(resid[i], 0));
+        for (int k = 0; k <= MAX_RICE_PARAM; ++k)
+            cost[k] += riceCost(u, k);
+    }
+    int best = 0;
+    for (int k = 1; k <= MAX_RICE_PARAM; ++k) {
+        if (cost[k] < cost[best])
+            best = k;
+    }
+    return best;
+}
+
+static inline bool fits16(int32_t v)
+{
+    return v >= INT16_MIN && v <= INT16_MAX;
+}
+
+// Picks the stereo mode whose pair of channels codes in the fewest bits.
+// 'split' is left, right, mid and side. The decoder keeps 16 bit samples,
+// so the side channel is only used if it (and its history) fits.
+static int chooseStereoMode(int format, bool adaptive, int32_t* const* split, int n,
+    const History& left, const History& right, int32_t* scratch)
+{
+    History h[4] = { left, right };
+    toCoded(Wav12Header::STEREO_MS, left.prev1, right.prev1, &h[2].prev1, &h[3].prev1);
+    toCoded(Wav12Header::STEREO_MS, left.prev2, right.prev2, &h[2].prev2, &h[3].prev2);
+    toCoded(Wav12Header::STEREO_MS, left.prev3, right.prev3, &h[2].prev3, &h[3].prev3);
+
+    bool sideFits = fits16(h[3].prev1) && fits16(h[3].prev2) && fits16(h[3].prev3);
+    for (int i = 0; i < n && sideFits; ++i)
+        sideFits = fits16(split[3][i]);
+
+    int64_t channelCost[4];
+    for (int c = 0; c < 4; ++c) {
+        int64_t cost[Wav12Header::NUM_PREDICTORS];
+        predictorCosts(format, split[c], n, h[c], scratch, cost);
+        channelCost[c] = cost[Wav12Header::NUM_PREDICTORS - 1];
+        for (int order = 0; adaptive && order < Wav12Header::NUM_PREDICTORS; ++order)
+            channelCost[c] = wMin(channelCost[c], cost[order]);
+    }
+
+    const int64_t modeCost[4] = {
+        channelCost[0] + channelCost[1],
+        channelCost[0] + channelCost[3],
+        channelCost[3] + channelCost[1],
+        channelCost[2] + channelCost[3],
+    };
+    int best = Wav12Header::STEREO_LR;
+    for (int mode = 1; sideFits && mode < 4; ++mode) {
+        if (modeCost[mode] < modeCost[best])
+            best = mode;
+    }
+    return best;
+}
+
+
+// Unblocked streams are coded this many samples at a time.
+static const int SPLIT_WINDOW = 1 << 16;
+
+// Left (or mono), right, mid, side for n frames.
+static void splitSamples(const int16_t* src, int n, int channels, int shiftBits, int32_t** split)
+{
+    for (int i = 0; i < n; ++i) {
+        int32_t left = src[i * channels] >> shiftBits;
+        split[0][i] = left;
+        if (channels == 2) {
+            int32_t right = src[i * 2 + 1] >> shiftBits;
+            split[1][i] = right;
+            toCoded(Wav12Header::STEREO_MS, left, right, &split[2][i], &split[3][i]);
+        }
+    }
+}
+
+// Writes a run of at least MIN_RUN zero residuals starting at 'resid',
+// if there is one, and returns its length; else returns 0.
+static int writeRun(BitWriter& writer, const int32_t* resid, int n, CompressStat* stats)
+{
+    n = wMin(n, MAX_RUN);
+    int run = 0;
+    while (run < n && resid[run] == 0)
+        ++run;
+    if (run < MIN_RUN)
+        return 0;
+
+    writer.write(0, RUN_ESCAPE_BITS);
+    uint32_t v = run - MIN_RUN;
+    int bits = BitAccum::bitsNeeded(v);
+    writer.write(bits - 1, 4);
+    writer.write(v, bits);
+    if (stats) {
+        stats->runs += 1;
+        stats->runSamples += run;
+    }
+    return run;
+}
+
+
+// The packing pass: 'delta' is the residual of 'sample', and (format 1)
+// 'bits' is the size of its magnitude.
+static inline void writeSample(BitWriter& writer, int format, int32_t sample, int32_t delta,
+    int bits, int riceParam, CompressStat* stats)
+{
+    if (format == Wav12Header::FORMAT_RICE) {
+        uint32_t u = zigZag(riceDelta(delta, 0));
+        uint32_t q = u >> riceParam;
+        if (q >= uint32_t(RICE_ESCAPE)) {
+            writer.write(0, RICE_ESCAPE);
+            writer.write(uint16_t(sample), 16);
+            if (stats)
+                stats->edgeWrites += 1;
+        }
+        else {
+            writer.write(1, q + 1);
+            if (riceParam)
+                writer.write(u & ((1U << riceParam) - 1), riceParam);
+            if (stats)
+                stats->buckets[BitAccum::bitsNeeded(u >> 1) - 1] += 1;
+        }
+        return;
+    }
+
+    assert(bits > 0);
+    if (bits > 15) {
+        // Edge case: it's possible to have a delta that needs 16 bits OR
+        // the guess has gone "out of range". In either case, all bits set
+        // indicates just read a value, not a delta.
+        writer.write(15, 4);
+        writer.write(uint16_t(sample), 16);
+
+        if (stats) 
+            stats->edgeWrites += 1;
+    }
+    else {
+        writer.write(bits - 1, 4); // Bits can be [1, 15], write out [0, 14]
+        writer.write(delta < 0 ? 0 : 1, 1);
+        writer.write(delta < 0 ? -delta : delta, bits);
+
+        if (stats) 
+            stats->buckets[bits - 1] += 1;
+    }
+}
+
+
 void wav12::linearCompress(const int16_t* data, int32_t nSamples, 
     uint8_t** compressed, int32_t* nCompressed, 
     int shiftBits,
     CompressStat* stats)
 {
-    const int SIZE = nSamples * 4;      // *4 is double size
-    *compressed = new uint8_t[SIZE];
-    BitWriter writer(*compressed, SIZE);
+    Wav12Header header;
+    memset(&header, 0, sizeof(header));
+    header.format = Wav12Header::FORMAT_LINEAR;
+    header.shiftBits = shiftBits;
+    linearCompress(data, nSamples, compressed, &header, stats);
+    *nCompressed = header.lenInBytes;
+}
 
-    if (stats) 
-        stats->shift = shiftBits;
-    int32_t prev3 = 0;
-    int32_t prev2 = 0;
-    int32_t prev1 = 0;
-    for (int i = 0; i < nSamples; i++) {
-        //int32_t guess = prev1 + prev1 - prev2;                                                // 0.67 on the test set
-        //int32_t guess = prev1 + (prev1 - prev2) + ((prev1 - prev2) - (prev2 - prev3)) / 2;    // 0.65 1614 (correct)
-        int32_t guess = 3 * prev1 - 3 * prev2 + prev3;                                          // 0.65 1616 simplified (no division)
-
-        int32_t sample = data[i] >> shiftBits;
-        int32_t delta = sample - guess;
-
-        int sign = 1;
-        if (delta < 0) {
-            sign = 0;
-            delta *= -1;
-        }
-
-        int bits = BitAccum::bitsNeeded(delta);
-        assert(bits > 0);
-        if (bits > 15) {
-            // Edge case: it's possible to have a delta that needs 16 bits OR
-            // the guess has gone "out of range". In either case, all bits set
-            // indicates just read a value, not a delta.
-            writer.write(15, 4);
-            writer.write(uint16_t(sample), 16);
 
-            if (stats) 
-                stats->edgeWrites += 1;
+static void initHeader(Wav12Header* header, int32_t nSamples)
+{
+    header->id[0] = 'w';
+    header->id[1] = 'v';
+    header->id[2] = '1';
+    header->id[3] = '2';
+    header->nSamples = nSamples;
+    assert(header->format == Wav12Header::FORMAT_LINEAR || header->format == Wav12Header::FORMAT_RICE);
+    if (header->usesBlocks() && header->blockShift == 0)
+        header->blockShift = Wav12Header::DEFAULT_BLOCK_SHIFT;
+}
+
+
+Compressor::Compressor(IOutStream* out, const Wav12Header& header, CompressStat* stats) :
+    m_writer(m_buffer, BUFFER_SIZE, out)
+{
+    assert(!(header.flags & Wav12Header::FLAG_SEEK_TABLE));
+    init(header, 0, stats);
+}
+
+
+Compressor::Compressor(uint8_t* compressed, int size, uint8_t* seekTable,
+    const Wav12Header& header, CompressStat* stats) :
+    m_writer(compressed, size)
+{
+    assert(seekTable || !(header.flags & Wav12Header::FLAG_SEEK_TABLE));
+    init(header, seekTable, stats);
+}
+
+
+void Compressor::init(const Wav12Header& header, uint8_t* seekTable, CompressStat* stats)
+{
+    m_header = header;
+    initHeader(&m_header, 0);
+    m_seekTable = seekTable;
+    m_stats = stats;
+    m_nSamples = 0;
+    m_nBlocks = 0;
+    m_nPending = 0;
+
+    // A block is coded whole. An unblocked stream has no choices made
+    // per block; it is coded a step at a time, with room after the step
+    // for a run to look ahead.
+    if (m_header.usesBlocks()) {
+        m_step = 1 << m_header.blockShift;
+        m_window = m_step;
+    }
+    else {
+        m_step = SPLIT_WINDOW;
+        m_window = SPLIT_WINDOW + MAX_RUN;
+    }
+    const int channels = m_header.channels();
+    m_pending = new int16_t[m_window * channels];
+    for (int c = 0; c < 4; ++c)
+        m_split[c] = c < (channels == 2 ? 4 : 1) ? new int32_t[m_window] : 0;
+    for (int c = 0; c < 2; ++c) {
+        m_resid[c] = c < channels ? new int32_t[m_window] : 0;
+        m_widths[c] = c < channels ? new uint8_t[m_window] : 0;
+    }
+    m_scratch = new int32_t[m_window];
+
+    if (m_stats)
+        m_stats->shift = m_header.shiftBits;
+}
+
+
+Compressor::~Compressor()
+{
+    delete[] m_pending;
+    for (int c = 0; c < 4; ++c)
+        delete[] m_split[c];
+    for (int c = 0; c < 2; ++c) {
+        delete[] m_resid[c];
+        delete[] m_widths[c];
+    }
+    delete[] m_scratch;
+}
+
+
+void Compressor::push(const int16_t* data, uint32_t nSamples)
+{
+    const int channels = m_header.channels();
+    m_nSamples += nSamples;
+
+    while (nSamples) {
+        if (m_nPending == 0 && nSamples >= uint32_t(m_window)) {
+            // Straight from the caller's samples.
+            code(data, m_step, m_window);
+            data += m_step * channels;
+            nSamples -= m_step;
+            continue;
         }
-        else {
-            writer.write(bits - 1, 4); // Bits can be [1, 15], write out [0, 14]
-            writer.write(sign, 1);
-            writer.write(delta, bits);
+        int n = wMin(int(nSamples), m_window - m_nPending);
+        memcpy(m_pending + m_nPending * channels, data, n * channels * sizeof(int16_t));
+        m_nPending += n;
+        data += n * channels;
+        nSamples -= n;
 
-            if (stats) 
-                stats->buckets[bits - 1] += 1;
+        if (m_nPending == m_window) {
+            code(m_pending, m_step, m_window);
+            m_nPending -= m_step;
+            memmove(m_pending, m_pending + m_step * channels, m_nPending * channels * sizeof(int16_t));
         }
+    }
+}
 
-        prev3 = prev2;
-        prev2 = prev1;
-        prev1 = sample;
+
+void Compressor::finish(Wav12Header* header)
+{
+    if (m_nPending)
+        code(m_pending, m_nPending, m_nPending);
+    m_nPending = 0;
+    m_writer.close();
+
+    m_header.nSamples = m_nSamples;
+    m_header.lenInBytes = m_header.dataOffset() + m_writer.length();
+    *header = m_header;
+}
+
+
+// Codes 'n' frames of 'src'; 'nLook' (at least n) are there to look ahead.
+void Compressor::code(const int16_t* src, int n, int nLook)
+{
+    const int format = m_header.format;
+    const bool rice = format == Wav12Header::FORMAT_RICE;
+    const bool runs = !rice && (m_header.flags & Wav12Header::FLAG_RUNS);
+    const bool adaptive = (m_header.flags & Wav12Header::FLAG_PREDICTOR) != 0;
+    const bool blocks = m_header.usesBlocks();
+    const int channels = m_header.channels();
+    int32_t** split = m_split;
+
+    // Left (or mono), right, mid, side.
+    splitSamples(src, nLook, channels, m_header.shiftBits, split);
+
+    History history[2];     // left (or mono) and right
+    for (int c = 0; c < channels; ++c) {
+        history[c].prev1 = int32_t(m_context[c].prev1);
+        history[c].prev2 = int32_t(m_context[c].prev2);
+        history[c].prev3 = int32_t(m_context[c].prev3);
+    }
+
+    if (m_seekTable) {
+        for (int c = 0; c < channels; ++c) {
+            SeekEntry entry;
+            entry.bitOffset = m_writer.bitPosition();
+            entry.prev[0] = int16_t(history[c].prev1);
+            entry.prev[1] = int16_t(history[c].prev2);
+            entry.prev[2] = int16_t(history[c].prev3);
+            entry.unused = 0;
+            memcpy(m_seekTable + (m_nBlocks * channels + c) * sizeof(SeekEntry),
+                &entry, sizeof(SeekEntry));
+        }
+    }
+
+    // The channels as coded, and their history.
+    int mode = Wav12Header::STEREO_LR;
+    const int32_t* coded[2] = { split[0], split[1] };
+    History h[2] = { history[0], history[1] };
+    if (channels == 2) {
+        mode = chooseStereoMode(format, adaptive, split, n, history[0], history[1], m_scratch);
+        m_writer.write(mode, 2);
+        if (m_stats)
+            m_stats->stereoModes[mode] += 1;
+
+        static const int CODED[4][2] = { { 0, 1 }, { 0, 3 }, { 3, 1 }, { 2, 3 } };
+        coded[0] = split[CODED[mode][0]];
+        coded[1] = split[CODED[mode][1]];
+        toCoded(mode, history[0].prev1, history[1].prev1, &h[0].prev1, &h[1].prev1);
+        toCoded(mode, history[0].prev2, history[1].prev2, &h[0].prev2, &h[1].prev2);
+        toCoded(mode, history[0].prev3, history[1].prev3, &h[0].prev3, &h[1].prev3);
+    }
+
+    // With the choices made, the residuals (and their sizes) of
+    // everything there is to look at.
+    int order[2] = { Wav12Header::NUM_PREDICTORS - 1, Wav12Header::NUM_PREDICTORS - 1 };
+    int riceParam[2] = { 0, 0 };
+    const int32_t* resid[2] = { m_resid[0], m_resid[1] };
+    const uint8_t* widths[2] = { m_widths[0], m_widths[1] };
+    for (int c = 0; c < channels; ++c) {
+        if (blocks && adaptive) {
+            order[c] = choosePredictor(format, coded[c], n, h[c], m_scratch);
+            m_writer.write(order[c], 2);
+            if (m_stats)
+                m_stats->predictors[order[c]] += 1;
+        }
+        residuals(coded[c], nLook, h[c], order[c], m_resid[c]);
+        if (!rice)
+            residualBits(m_resid[c], nLook, m_widths[c]);
+        if (blocks && rice) {
+            riceParam[c] = chooseRiceParam(resid[c], n);
+            m_writer.write(riceParam[c], 4);
+            if (m_stats)
+                m_stats->riceParams[riceParam[c]] += 1;
+        }
+    }
+
+    // The packing pass. Channels are interleaved sample by sample. A run
+    // covers samples of its own channel only, and (with blocks) ends
+    // with the block.
+    uint32_t runLeft[2] = { m_context[0].run, m_context[1].run };
+    for (int i = 0; i < n; i++) {
+        for (int c = 0; c < channels; ++c) {
+            if (runLeft[c]) {
+                --runLeft[c];
+                continue;
+            }
+            const int32_t delta = resid[c][i];
+            if (runs && delta == 0) {
+                int run = writeRun(m_writer, resid[c] + i, nLook - i, m_stats);
+                if (run) {
+                    runLeft[c] = run - 1;
+                    continue;
+                }
+            }
+            writeSample(m_writer, format, coded[c][i], delta, rice ? 0 : widths[c][i],
+                riceParam[c], m_stats);
+        }
+    }
+    for (int c = 0; c < channels; ++c) {
+        for (int i = wMax(0, n - 3); i < n; ++i)
+            h[c].push(coded[c][i]);
+    }
+
+    if (channels == 2) {
+        fromCoded(mode, h[0].prev1, h[1].prev1, &history[0].prev1, &history[1].prev1);
+        fromCoded(mode, h[0].prev2, h[1].prev2, &history[0].prev2, &history[1].prev2);
+        fromCoded(mode, h[0].prev3, h[1].prev3, &history[0].prev3, &history[1].prev3);
+    }
+    else {
+        history[0] = h[0];
+    }
+    for (int c = 0; c < channels; ++c) {
+        m_context[c].prev1 = uint32_t(history[c].prev1);
+        m_context[c].prev2 = uint32_t(history[c].prev2);
+        m_context[c].prev3 = uint32_t(history[c].prev3);
+        m_context[c].run = runLeft[c];
+    }
+    if (blocks)
+        ++m_nBlocks;
+}
+
+
+uint32_t wav12::maxCompressedSize(int32_t nSamples, const Wav12Header& layout)
+{
+    Wav12Header header = layout;
+    initHeader(&header, nSamples);
+    const int channels = header.channels();
+
+    // Format 1: a 4 bit length, sign and up to 15 bits, or the 4 bit
+    // escape and 16 bits. A run is always shorter than its samples.
+    // Format 2: residuals wrap to 16 bits, so with the parameter at 15
+    // every code is at most 17 bits; the chosen parameter is no worse.
+    uint64_t bits = uint64_t(nSamples) * channels
+        * (header.format == Wav12Header::FORMAT_RICE ? MAX_RICE_PARAM + 2 : 20);
+    if (header.usesBlocks()) {
+        int blockBits = (channels == 2 ? 2 : 0)
+            + (header.flags & Wav12Header::FLAG_PREDICTOR ? 2 * channels : 0)
+            + (header.format == Wav12Header::FORMAT_RICE ? 4 * channels : 0);
+        bits += uint64_t(header.nBlocks()) * blockBits;
+    }
+    return header.dataOffset() + uint32_t((bits + 7) / 8);
+}
+
+
+uint32_t wav12::maxCompressedSize(int32_t nSamples)
+{
+    Wav12Header header;
+    memset(&header, 0, sizeof(header));
+    header.format = Wav12Header::FORMAT_LINEAR;
+    return maxCompressedSize(nSamples, header);
+}
+
+
+void wav12::linearCompress(const int16_t* data, int32_t nSamples,
+    uint8_t* compressed, uint32_t size, Wav12Header* header,
+    CompressStat* stats)
+{
+    initHeader(header, nSamples);
+    assert(size >= maxCompressedSize(nSamples, *header));
+
+    const uint32_t dataOffset = header->dataOffset();
+    memset(compressed, 0, header->extSize());
+    uint8_t* seekTable = (header->flags & Wav12Header::FLAG_SEEK_TABLE) ? compressed + header->extSize() : 0;
+    Compressor compressor(compressed + dataOffset, int(size - dataOffset), seekTable, *header, stats);
+    compressor.push(data, nSamples);
+    compressor.finish(header);
+}
+
+
+void wav12::linearCompress(const int16_t* data, int32_t nSamples,
+    uint8_t** compressed, Wav12Header* header,
+    CompressStat* stats)
+{
+    const uint32_t size = maxCompressedSize(nSamples, *header);
+    *compressed = new uint8_t[size];
+    linearCompress(data, nSamples, *compressed, size, header, stats);
+}
+
+
+void wav12::linearCompress(const int16_t* data, int32_t nSamples,
+    IOutStream* out, Wav12Header* header,
+    CompressStat* stats)
+{
+    Compressor compressor(out, *header, stats);
+    compressor.push(data, nSamples);
+    compressor.finish(header);
+}
+
+// The decoder looks up the next DECODE_TABLE_BITS of the stream at once.
+// Symbols (4 bit length, sign, magnitude) that fit in the window are
+// decoded straight from the table, and when two fit, both are.
+#ifndef WAV12_DECODE_TABLE_BITS
+#define WAV12_DECODE_TABLE_BITS 12
+#endif
+
+struct DecodeEntry
+{
+    uint8_t nSym;       // 0: the next symbol is longer than the window.
+    uint8_t len;        // low nibble: bits of the 1st symbol, high nibble: of the 2nd
+    int8_t delta[2];
+};
+
+static const int DECODE_TABLE_BITS = WAV12_DECODE_TABLE_BITS;
+// A symbol of 12 bits has 7 bits of magnitude, the most 'delta' holds.
+static_assert(DECODE_TABLE_BITS >= 6 && DECODE_TABLE_BITS <= 12, "delta is 8 bits");
+
+// Decodes the symbol at the top of a 'nBits' wide window.
+// Returns its length, or 0 if it doesn't fit.
+static int decodeShortSymbol(uint32_t window, int nBits, int8_t* delta)
+{
+    if (nBits < 6)
+        return 0;
+    uint32_t prefix = (window >> (nBits - 4)) & 15;
+    if (prefix == 15)
+        return 0;
+    int magBits = prefix + 1;
+    int len = 5 + magBits;
+    if (len > nBits)
+        return 0;
+    if (prefix == 0 && ((window >> (nBits - RUN_ESCAPE_BITS)) & 3) == 0)
+        return 0;   // run escape
+    uint32_t v = (window >> (nBits - len)) & ((1U << (magBits + 1)) - 1);
+    int32_t mag = v & ((1U << magBits) - 1);
+    *delta = int8_t((v >> magBits) ? mag : -mag);
+    return len;
+}
+
+struct DecodeTable
+{
+    DecodeEntry entry[1 << DECODE_TABLE_BITS];
+};
+
+static DecodeTable buildDecodeTable()
+{
+    DecodeTable table;
+    for (uint32_t w = 0; w < (1U << DECODE_TABLE_BITS); ++w) {
+        DecodeEntry& e = table.entry[w];
+        e.nSym = 0;
+        e.len = 0;
+        e.delta[0] = e.delta[1] = 0;
+
+        int len0 = decodeShortSymbol(w, DECODE_TABLE_BITS, &e.delta[0]);
+        if (len0) {
+            e.nSym = 1;
+            e.len = len0;
+            int len1 = decodeShortSymbol(w, DECODE_TABLE_BITS - len0, &e.delta[1]);
+            if (len1) {
+                e.nSym = 2;
+                e.len |= len1 << 4;
+            }
+        }
+    }
+    return table;
+}
+
+// Built once, on first use; the initialization of a local static is
+// thread safe, so Expanders on several threads can share it.
+static const DecodeEntry* decodeTable()
+{
+    static const DecodeTable table = buildDecodeTable();
+    return table.entry;
+}
+
+
+// The volume of expand2 is a constant, or a VolumeRamp from one value
+// to another over the call, in fixed point with RAMP_SHIFT bits of
+// fraction. Volumes are at most 65536, so that's 31 bits.
+static const int RAMP_SHIFT = 14;
+
+struct VolumeRamp
+{
+    int32_t value;      // of the next frame
+    int32_t step;       // per frame
+};
+
+// The volume 'i' frames on, and moving on 'n' frames.
+template<typename V>
+static inline V volumeAt(const V& volume, int) { return volume; }
+static inline int32_t volumeAt(const VolumeRamp& ramp, int i) { return (ramp.value + i * ramp.step) >> RAMP_SHIFT; }
+
+template<typename V>
+static inline void advance(V&, int) {}
+static inline void advance(VolumeRamp& ramp, int n) { ramp.value += n * ramp.step; }
+
+// From volumeStart toward volumeEnd over n frames.
+static inline VolumeRamp volumeRamp(uint32_t n, int32_t volumeStart, int32_t volumeEnd)
+{
+    assert(wMax(abs(volumeStart), abs(volumeEnd)) <= 65536);
+    VolumeRamp ramp;
+    ramp.value = volumeStart * (1 << RAMP_SHIFT);
+    ramp.step = n ? int32_t(int64_t(volumeEnd - volumeStart) * (1 << RAMP_SHIFT) / int32_t(n)) : 0;
+    return ramp;
+}
+
+template<typename V>
+static inline bool constantVolume(const V&) { return true; }
+static inline bool constantVolume(const VolumeRamp& ramp) { return ramp.step == 0; }
+
+
+// ADD mixes into the target, rather than overwriting it.
+template<typename T, int CHANNELS, bool ADD, typename V>
+static inline void linearStore(wav12::Context& context, int16_t sample,
+    int shiftBits, T*& target, V& volume)
+{
+    const T v = T((sample << shiftBits) * volumeAt(volume, 0));
+    advance(volume, 1);
+    for (int c = 0; c < CHANNELS; ++c) {
+        if (ADD)
+            *target += v;
+        else
+            *target = v;
+        ++target;
+    }
+
+    context.prev3 = context.prev2;
+    context.prev2 = context.prev1;
+    context.prev1 = sample;
+}
+
+
+template<int ORDER>
+static inline int32_t predict(const wav12::Context& context)
+{
+    return predict<ORDER>(int32_t(context.prev1), int32_t(context.prev2), int32_t(context.prev3));
+}
+
+
+// Writes 'n' samples of a zero residual run.
+template<typename T, int CHANNELS, bool ADD, int ORDER, typename V>
+static inline void linearFill(wav12::Context& context, int shiftBits, T*& target, int n, V& volume)
+{
+    bool constant = constantVolume(volume) && (ORDER <= 1
+        || (context.prev1 == context.prev2 && (ORDER == 2 || context.prev2 == context.prev3)));
+    if (!constant) {
+        for (int i = 0; i < n; ++i)
+            linearStore<T, CHANNELS, ADD>(context, int16_t(predict<ORDER>(context)), shiftBits, target, volume);
+        return;
+    }
+    // Flat: the same value over and over.
+    int16_t sample = int16_t(predict<ORDER>(context));
+    T v = T((sample << shiftBits) * volumeAt(volume, 0));
+    for (int i = 0; i < n * CHANNELS; ++i) {
+        if (ADD)
+            target[i] += v;
+        else
+            target[i] = v;
+    }
+    target += n * CHANNELS;
+    for (int i = 0; i < n && i < 3; ++i) {
+        context.prev3 = context.prev2;
+        context.prev2 = context.prev1;
+        context.prev1 = sample;
     }
-    writer.close();
-    *nCompressed = writer.length();
 }
 
-template<typename T, int CHANNELS>
+
+template<typename T, int CHANNELS, bool ADD, int ORDER, bool CHECKED, typename V>
 void innerLinearExpand(BitReader& reader, wav12::Context& context,
-    int shiftBits, T* target, int n, T volume)
+    int shiftBits, T* target, int n, V& volume)
 {
-    for (int i = 0; i < n; ++i) {
-        int32_t guess = 3 * context.prev1 - 3 * context.prev2 + context.prev3;
+    const DecodeEntry* table = decodeTable();
+
+    int i = 0;
+    while (i < n) {
+        if (context.run) {
+            int k = wMin(n - i, int(context.run));
+            linearFill<T, CHANNELS, ADD, ORDER>(context, shiftBits, target, k, volume);
+            context.run -= k;
+            i += k;
+            continue;
+        }
+        int32_t guess = predict<ORDER>(context);
+
+        uint32_t window = reader.peek<CHECKED>(DECODE_TABLE_BITS);
+        const DecodeEntry& e = table[window];
+        if (e.nSym) {
+            reader.consume<CHECKED>(e.len & 15);
+            linearStore<T, CHANNELS, ADD>(context, int16_t(guess + e.delta[0]), shiftBits, target, volume);
+            ++i;
+
+            if (e.nSym == 2 && i < n) {
+                guess = predict<ORDER>(context);
+                reader.consume<CHECKED>(e.len >> 4);
+                linearStore<T, CHANNELS, ADD>(context, int16_t(guess + e.delta[1]), shiftBits, target, volume);
+                ++i;
+            }
+            continue;
+        }
 
-        uint32_t nBits = reader.read(4);
+        uint32_t nBits = window >> (DECODE_TABLE_BITS - 4);
+        reader.consume<CHECKED>(4);
         int16_t sample = 0;
         if (nBits == 15) {
-            sample = int16_t(reader.read(16));
+            sample = int16_t(reader.read<CHECKED>(16));
         }
         else {
             nBits++;
-            assert(nBits > 0 && nBits < 16);
-            uint32_t sign = reader.read(1);
-            uint32_t scalar = reader.read(nBits);
+            if (CHECKED)
+                assert(nBits > 0 && nBits < 16);
+            // Sign bit and magnitude in one read.
+            uint32_t v = reader.read<CHECKED>(nBits + 1);
+            if (v == 0 && nBits == 1) {
+                uint32_t runBits = reader.read<CHECKED>(4) + 1;
+                context.run = MIN_RUN + reader.read<CHECKED>(runBits);
+                continue;
+            }
+            uint32_t sign = v >> nBits;
+            uint32_t scalar = v & ((1U << nBits) - 1);
 
             int16_t delta = int16_t(scalar) * (sign == 1 ? 1 : -1);
             sample = guess + delta;
         }
-        for (int c = 0; c < CHANNELS; ++c) {
-            *target = (sample << shiftBits) * volume;
-            ++target;
+        linearStore<T, CHANNELS, ADD>(context, sample, shiftBits, target, volume);
+        ++i;
+    }
+}
+
+
+template<bool CHECKED>
+static inline int16_t riceSample(BitReader& reader, int riceParam, int32_t guess)
+{
+    // The longest code, RICE_ESCAPE - 1 zeros, the 1, and 15 bits, fits the window.
+    uint32_t window = reader.peek<CHECKED>(32);
+    int q = BitAccum::leadingZeros(window);
+    if (q >= RICE_ESCAPE) {
+        reader.consume<CHECKED>(RICE_ESCAPE);
+        return int16_t(reader.read<CHECKED>(16));
+    }
+    int len = q + 1 + riceParam;
+    uint32_t u = (uint32_t(q) << riceParam) | ((window >> (32 - len)) & ((1U << riceParam) - 1));
+    reader.consume<CHECKED>(len);
+    int32_t delta = int32_t(u >> 1) ^ -int32_t(u & 1);
+    return int16_t(guess + delta);
+}
+
+
+template<typename T, int CHANNELS, bool ADD, int ORDER, bool CHECKED, typename V>
+void innerRiceExpand(BitReader& reader, wav12::Context& context,
+    int shiftBits, int riceParam, T* target, int n, V& volume)
+{
+    for (int i = 0; i < n; ++i) {
+        int16_t sample = riceSample<CHECKED>(reader, riceParam, predict<ORDER>(context));
+        linearStore<T, CHANNELS, ADD>(context, sample, shiftBits, target, volume);
+    }
+}
+
+
+// One sample of one channel of a stereo stream. The predictor order
+// changes per block and channel, so it isn't a template parameter here.
+template<int FORMAT, bool CHECKED>
+static inline int16_t stereoSample(BitReader& reader, wav12::Context& context,
+    int order, int riceParam)
+{
+    int32_t guess = predict(order, int32_t(context.prev1), int32_t(context.prev2), int32_t(context.prev3));
+    int16_t sample = int16_t(guess);
+    if (context.run) {
+        --context.run;
+    }
+    else if (FORMAT == Wav12Header::FORMAT_RICE) {
+        sample = riceSample<CHECKED>(reader, riceParam, guess);
+    }
+    else {
+        const DecodeEntry& e = decodeTable()[reader.peek<CHECKED>(DECODE_TABLE_BITS)];
+        if (e.nSym) {
+            reader.consume<CHECKED>(e.len & 15);
+            sample = int16_t(guess + e.delta[0]);
+        }
+        else {
+            uint32_t nBits = reader.read<CHECKED>(4);
+            if (nBits == 15) {
+                sample = int16_t(reader.read<CHECKED>(16));
+            }
+            else {
+                nBits++;
+                uint32_t v = reader.read<CHECKED>(nBits + 1);
+                if (v == 0 && nBits == 1) {
+                    // A run starts with this sample.
+                    uint32_t runBits = reader.read<CHECKED>(4) + 1;
+                    context.run = MIN_RUN + reader.read<CHECKED>(runBits) - 1;
+                }
+                else {
+                    uint32_t scalar = v & ((1U << nBits) - 1);
+                    sample = int16_t(guess + ((v >> nBits) ? int32_t(scalar) : -int32_t(scalar)));
+                }
+            }
         }
+    }
+    context.prev3 = context.prev2;
+    context.prev2 = context.prev1;
+    context.prev1 = sample;
+    return sample;
+}
 
-        context.prev3 = context.prev2;
-        context.prev2 = context.prev1;
-        context.prev1 = sample;
+
+template<typename T, bool ADD, int FORMAT, bool CHECKED, typename V>
+void innerStereoExpand(BitReader& reader, wav12::Context* context,
+    const int* order, const int* riceParam, int mode,
+    int shiftBits, T* target, int n, V& volume)
+{
+    for (int i = 0; i < n; ++i) {
+        int32_t c0 = stereoSample<FORMAT, CHECKED>(reader, context[0], order[0], riceParam[0]);
+        int32_t c1 = stereoSample<FORMAT, CHECKED>(reader, context[1], order[1], riceParam[1]);
+        int32_t left, right;
+        fromCoded(mode, c0, c1, &left, &right);
+        const int32_t v = volumeAt(volume, 0);
+        advance(volume, 1);
+        if (ADD) {
+            target[0] += T((left << shiftBits) * v);
+            target[1] += T((right << shiftBits) * v);
+        }
+        else {
+            target[0] = T((left << shiftBits) * v);
+            target[1] = T((right << shiftBits) * v);
+        }
+        target += 2;
     }
 }
 
@@ -103,7 +1170,21 @@ void wav12::linearExpand(const uint8_t* compressed, int nCompressed,
 {
     BitReader reader(compressed, nCompressed);
     Context context;
-    innerLinearExpand<int16_t, 1>(reader, context, shiftBits, data, nSamples, 1);
+    int16_t volume = 1;
+    innerLinearExpand<int16_t, 1, false, 3, false>(reader, context, shiftBits, data, nSamples, volume);
+}
+
+
+void wav12::linearExpand(const Wav12Header& header, const uint8_t* compressed,
+    int16_t* data)
+{
+    if (header.format == 0) {
+        memcpy(data, compressed + header.dataOffset(), header.nSamples * header.channels() * 2);
+        return;
+    }
+    MemStream stream(compressed, header.lenInBytes);
+    Expander expander(&stream, header);
+    expander.expand(data, header.nSamples);
 }
 
 
@@ -119,49 +1200,603 @@ Expander::Expander(IStream* stream, uint32_t nSamples, int format, int shiftBits
 }
 
 
+Expander::Expander(IStream* stream, const Wav12Header& header)
+{
+    init(stream, header);
+}
+
+
 void Expander::init(IStream* stream, uint32_t nSamples, int format, int shiftBits)
 {
     m_stream = stream;
     m_nSamples = nSamples;
     m_pos = 0;
+    m_context[0] = m_context[1] = Context();
     m_format = format;
     m_shiftBits = shiftBits;
-    m_bitReader.init(stream);
+    m_flags = 0;
+    m_blockShift = 0;
+    m_tableOffset = 0;
+    m_dataOffset = 0;
+    m_rate = Wav12Header::DEFAULT_RATE;
+    m_channels = 1;
+    m_stereoMode = Wav12Header::STEREO_LR;
+    m_predictor[0] = m_predictor[1] = Wav12Header::NUM_PREDICTORS - 1;
+    m_riceParam[0] = m_riceParam[1] = 0;
+    m_checked = false;
+    m_dataEnd = BitReader::NO_LIMIT;    // unknown
+    startBits(0);
+    m_looping = false;
+    m_marked = false;
+    m_loopStart = m_loopEnd = 0;
+    m_step = STEP_ONE;
+    m_interpolation = INTERPOLATE_LINEAR;
+    m_primed = false;
+}
+
+
+void Expander::init(IStream* stream, const Wav12Header& header)
+{
+    init(stream, header.nSamples, header.format, header.shiftBits);
+    if (!header.valid()) {
+        // Nothing to decode.
+        m_nSamples = 0;
+        return;
+    }
+    m_channels = header.channels();
+    m_flags = header.flags;
+    m_tableOffset = header.extSize();
+    m_dataOffset = header.dataOffset();
+
+    uint32_t pos = 0;
+    if (header.flags & Wav12Header::FLAG_RATE)
+        pos += m_stream->read((uint8_t*)&m_rate, 4);
+
+    // Get past the tables to the bitstream.
+    if (m_dataOffset > pos && !m_stream->seek(m_dataOffset)) {
+        uint8_t buf[16];
+        for (uint32_t n = m_dataOffset - pos; n; ) {
+            int r = m_stream->read(buf, wMin(n, uint32_t(16)));
+            if (r <= 0) {
+                // The stream ends before the data: nothing to decode.
+                m_nSamples = 0;
+                return;
+            }
+            n -= r;
+        }
+    }
+    if (header.format == 0)
+        return;
+
+    m_blockShift = header.blockShift;
+    m_dataEnd = wMax(header.lenInBytes, m_dataOffset);
+    startBits(m_dataOffset);
+}
+
+
+bool Expander::seek(uint32_t sample)
+{
+    m_primed = false;
+    return seekSample(sample);
+}
+
+
+bool Expander::seekSample(uint32_t sample)
+{
+    assert(sample <= m_nSamples);
+    if (m_format == 0) {
+        if (!m_stream->seek(m_dataOffset + sample * 2 * m_channels))
+            return false;
+        m_pos = sample;
+        return true;
+    }
+
+    // Seeking to the end uses the last block.
+    uint32_t block = (sample && sample == m_nSamples ? sample - 1 : sample) >> m_blockShift;
+    bool sameBlock = (m_pos >> m_blockShift) == block && m_pos <= sample;
+
+    if (m_flags & Wav12Header::FLAG_SEEK_TABLE) {
+        if (!sameBlock) {
+            SeekEntry entry[2];
+            if (!m_stream->seek(m_tableOffset + block * m_channels * sizeof(SeekEntry)))
+                return false;
+            const int nEntry = int(m_channels * sizeof(SeekEntry));
+            if (m_stream->read((uint8_t*)entry, nEntry) != nEntry)
+                return false;
+            const uint32_t offset = m_dataOffset + entry[0].bitOffset / 8;
+            if (!m_stream->seek(offset))
+                return false;
+            startBits(offset);
+            if (entry[0].bitOffset & 7)
+                m_bitReader.read(entry[0].bitOffset & 7);
+
+            // The entries are left and right, whatever the block codes.
+            for (int c = 0; c < m_channels; ++c) {
+                m_context[c].prev1 = entry[c].prev[0];
+                m_context[c].prev2 = entry[c].prev[1];
+                m_context[c].prev3 = entry[c].prev[2];
+                m_context[c].run = 0;
+            }
+            m_stereoMode = Wav12Header::STEREO_LR;
+            m_pos = block << m_blockShift;
+        }
+    }
+    else if (sample < m_pos) {
+        if (!m_stream->seek(m_dataOffset))
+            return false;
+        startBits(m_dataOffset);
+        m_context[0] = m_context[1] = Context();
+        m_stereoMode = Wav12Header::STEREO_LR;
+        m_pos = 0;
+    }
+    skip(sample - m_pos);
+    return true;
+}
+
+
+// Starts reading bits at 'offset' in the stream, where the stream is.
+void Expander::startBits(uint32_t offset)
+{
+    m_bitBase = offset;
+    if (m_dataEnd == BitReader::NO_LIMIT)
+        m_bitReader.init(m_stream);
+    else
+        m_bitReader.init(m_stream, m_dataEnd - wMin(offset, m_dataEnd));
+}
+
+
+void Expander::skip(uint32_t n)
+{
+    static const int CHUNK = 32;
+    int16_t buf[CHUNK * 2];
+    while (n) {
+        uint32_t k = wMin(n, uint32_t(CHUNK));
+        expandSamples(buf, k);
+        n -= k;
+    }
+}
+
+
+// Moves the history of the coded channels to a new pair.
+void Expander::setStereoMode(int mode)
+{
+    uint32_t* prev[2][3] = {
+        { &m_context[0].prev1, &m_context[0].prev2, &m_context[0].prev3 },
+        { &m_context[1].prev1, &m_context[1].prev2, &m_context[1].prev3 },
+    };
+    for (int i = 0; i < 3; ++i) {
+        int32_t left, right, c0, c1;
+        fromCoded(m_stereoMode, int32_t(*prev[0][i]), int32_t(*prev[1][i]), &left, &right);
+        toCoded(mode, left, right, &c0, &c1);
+        *prev[0][i] = uint32_t(c0);
+        *prev[1][i] = uint32_t(c1);
+    }
+    m_stereoMode = mode;
+}
+
+
+template<typename T, int CHANNELS, bool ADD, bool CHECKED, typename V>
+void Expander::expandLinear(T* target, uint32_t nTarget, V volume)
+{
+    const uint32_t blockMask = (1 << m_blockShift) - 1;
+    const bool adaptive = (m_flags & Wav12Header::FLAG_PREDICTOR) != 0;
+    const bool rice = m_format == Wav12Header::FORMAT_RICE;
+    Context& context = m_context[0];
+
+    while (nTarget) {
+        // Decode up to the end of the block, where the predictor and
+        // Rice parameter can change.
+        uint32_t n = nTarget;
+        if (adaptive || rice) {
+            if ((m_pos & blockMask) == 0) {
+                if (adaptive)
+                    m_predictor[0] = m_bitReader.read<CHECKED>(2);
+                if (rice)
+                    m_riceParam[0] = m_bitReader.read<CHECKED>(4);
+            }
+            n = wMin(n, blockMask + 1 - (m_pos & blockMask));
+        }
+
+        const int riceParam = m_riceParam[0];
+        if (rice) {
+            switch (m_predictor[0]) {
+            case 0: innerRiceExpand<T, CHANNELS, ADD, 0, CHECKED>(m_bitReader, context, m_shiftBits, riceParam, target, n, volume); break;
+            case 1: innerRiceExpand<T, CHANNELS, ADD, 1, CHECKED>(m_bitReader, context, m_shiftBits, riceParam, target, n, volume); break;
+            case 2: innerRiceExpand<T, CHANNELS, ADD, 2, CHECKED>(m_bitReader, context, m_shiftBits, riceParam, target, n, volume); break;
+            default: innerRiceExpand<T, CHANNELS, ADD, 3, CHECKED>(m_bitReader, context, m_shiftBits, riceParam, target, n, volume); break;
+            }
+        }
+        else {
+            switch (m_predictor[0]) {
+            case 0: innerLinearExpand<T, CHANNELS, ADD, 0, CHECKED>(m_bitReader, context, m_shiftBits, target, n, volume); break;
+            case 1: innerLinearExpand<T, CHANNELS, ADD, 1, CHECKED>(m_bitReader, context, m_shiftBits, target, n, volume); break;
+            case 2: innerLinearExpand<T, CHANNELS, ADD, 2, CHECKED>(m_bitReader, context, m_shiftBits, target, n, volume); break;
+            default: innerLinearExpand<T, CHANNELS, ADD, 3, CHECKED>(m_bitReader, context, m_shiftBits, target, n, volume); break;
+            }
+        }
+        target += n * CHANNELS;
+        m_pos += n;
+        nTarget -= n;
+    }
+}
+
+
+template<typename T, bool ADD, bool CHECKED, typename V>
+void Expander::expandStereo(T* target, uint32_t nTarget, V volume)
+{
+    const uint32_t blockMask = (1 << m_blockShift) - 1;
+    const bool adaptive = (m_flags & Wav12Header::FLAG_PREDICTOR) != 0;
+    const bool rice = m_format == Wav12Header::FORMAT_RICE;
+
+    while (nTarget) {
+        // Stereo is always in blocks: mode, then per channel the
+        // predictor and Rice parameter.
+        if ((m_pos & blockMask) == 0) {
+            setStereoMode(m_bitReader.read<CHECKED>(2));
+            for (int c = 0; c < 2; ++c) {
+                if (adaptive)
+                    m_predictor[c] = m_bitReader.read<CHECKED>(2);
+                if (rice)
+                    m_riceParam[c] = m_bitReader.read<CHECKED>(4);
+            }
+        }
+        uint32_t n = wMin(nTarget, blockMask + 1 - (m_pos & blockMask));
+
+        if (rice)
+            innerStereoExpand<T, ADD, Wav12Header::FORMAT_RICE, CHECKED>(m_bitReader, m_context, m_predictor, m_riceParam,
+                m_stereoMode, m_shiftBits, target, n, volume);
+        else
+            innerStereoExpand<T, ADD, Wav12Header::FORMAT_LINEAR, CHECKED>(m_bitReader, m_context, m_predictor, m_riceParam,
+                m_stereoMode, m_shiftBits, target, n, volume);
+        target += n * 2;
+        m_pos += n;
+        nTarget -= n;
+    }
+}
+
+
+bool Expander::setLoop(uint32_t start, uint32_t end)
+{
+    if (end == 0)
+        end = m_nSamples;
+    assert(start <= end && end <= m_nSamples);
+    // Seeking to where the stream is already changes nothing, and
+    // fails if it can't seek at all.
+    uint32_t streamPos = m_format == 0 ? m_dataOffset + m_pos * 2 * m_channels
+        : m_bitBase + m_bitReader.streamBytes();
+    if (!m_stream || !m_stream->seek(streamPos)) {
+        m_looping = false;
+        return false;
+    }
+    // A new start needs a new mark.
+    m_marked = m_marked && start == m_loopStart;
+    m_looping = start < end;
+    m_loopStart = start;
+    m_loopEnd = end;
+    return true;
+}
+
+
+uint32_t Expander::toLoopPoint() const
+{
+    if (!m_marked && m_format != 0 && m_pos < m_loopStart)
+        return m_loopStart - m_pos;
+    return m_loopEnd - m_pos;
+}
+
+
+bool Expander::loopPoint()
+{
+    if (m_pos >= m_loopEnd) {
+        bool okay = false;
+        if (m_marked) {
+            okay = m_stream->seek(m_mark.bitBase + m_mark.bitReader.streamBytes());
+            if (okay) {
+                m_bitReader = m_mark.bitReader;
+                m_bitBase = m_mark.bitBase;
+                m_context[0] = m_mark.context[0];
+                m_context[1] = m_mark.context[1];
+                m_stereoMode = m_mark.stereoMode;
+                m_predictor[0] = m_mark.predictor[0];
+                m_predictor[1] = m_mark.predictor[1];
+                m_riceParam[0] = m_mark.riceParam[0];
+                m_riceParam[1] = m_mark.riceParam[1];
+                m_pos = m_loopStart;
+            }
+        }
+        else {
+            // Raw samples seek straight there; anything else decodes
+            // its way there, once.
+            okay = seekSample(m_loopStart);
+        }
+        if (!okay) {
+            // The sound ends here, rather than run on past the loop.
+            m_looping = false;
+            m_pos = m_nSamples;
+            return false;
+        }
+    }
+    if (!m_marked && m_format != 0 && m_pos == m_loopStart) {
+        m_mark.bitReader = m_bitReader;
+        m_mark.bitBase = m_bitBase;
+        m_mark.context[0] = m_context[0];
+        m_mark.context[1] = m_context[1];
+        m_mark.stereoMode = m_stereoMode;
+        m_mark.predictor[0] = m_predictor[0];
+        m_mark.predictor[1] = m_predictor[1];
+        m_mark.riceParam[0] = m_riceParam[0];
+        m_mark.riceParam[1] = m_riceParam[1];
+        m_marked = true;
+    }
+    return true;
 }
 
 
 void Expander::expand(int16_t* target, uint32_t nTarget)
+{
+    if (!m_looping) {
+        expandSamples(target, nTarget);
+        return;
+    }
+    while (nTarget) {
+        if (!loopPoint()) {
+            memset(target, 0, nTarget * m_channels * sizeof(int16_t));
+            return;
+        }
+        uint32_t n = wMin(nTarget, toLoopPoint());
+        expandSamples(target, n);
+        target += n * m_channels;
+        nTarget -= n;
+    }
+}
+
+
+void Expander::expandSamples(int16_t* target, uint32_t nTarget)
 {
     assert(nTarget <= (m_nSamples - m_pos));
-    m_pos += nTarget;
 
     if (m_format == 0) {
-        while (nTarget--) {
-            *target++ = m_stream->get16();
-        }
+        // Samples are stored little-endian, same as the target.
+        m_stream->read((uint8_t*)target, nTarget * 2 * m_channels);
+        m_pos += nTarget;
+    }
+    else if (m_channels == 2) {
+        if (m_checked)
+            expandStereo<int16_t, false, true>(target, nTarget, int16_t(1));
+        else
+            expandStereo<int16_t, false, false>(target, nTarget, int16_t(1));
     }
     else {
-        innerLinearExpand<int16_t, 1>(m_bitReader, m_context, m_shiftBits, target, nTarget, 1);
+        if (m_checked)
+            expandLinear<int16_t, 1, false, true>(target, nTarget, int16_t(1));
+        else
+            expandLinear<int16_t, 1, false, false>(target, nTarget, int16_t(1));
     }
 }
 
 
-void Expander::expand2(int32_t* target, uint32_t nTarget, int32_t volume)
+// Raw samples to stereo frames. The volume is from the frame index,
+// not carried from frame to frame, so the loop vectorizes.
+template<int CHANNELS, bool ADD, typename V>
+static inline void scaleRaw(const int16_t* src, int n, const V& volume, int32_t* target)
 {
-    m_pos += nTarget;
+    for (int i = 0; i < n; ++i) {
+        const int32_t v = volumeAt(volume, i);
+        const int32_t left = src[i * CHANNELS] * v;
+        const int32_t right = src[i * CHANNELS + CHANNELS - 1] * v;
+        if (ADD) {
+            target[i * 2] += left;
+            target[i * 2 + 1] += right;
+        }
+        else {
+            target[i * 2] = left;
+            target[i * 2 + 1] = right;
+        }
+    }
+}
+
+
+template<bool ADD, typename V>
+void Expander::expandTo32(int32_t* target, uint32_t nTarget, V volume)
+{
+    if (!m_looping) {
+        expandSamplesTo32<ADD>(target, nTarget, volume);
+        return;
+    }
+    while (nTarget) {
+        if (!loopPoint()) {
+            if (!ADD)
+                memset(target, 0, nTarget * 2 * sizeof(int32_t));
+            return;
+        }
+        uint32_t n = wMin(nTarget, toLoopPoint());
+        expandSamplesTo32<ADD>(target, n, volume);
+        advance(volume, n);
+        target += n * 2;
+        nTarget -= n;
+    }
+}
+
+
+template<bool ADD, typename V>
+void Expander::expandSamplesTo32(int32_t* target, uint32_t nTarget, V volume)
+{
+    assert(nTarget <= (m_nSamples - m_pos));
+
     if (m_format == 0) {
-        while (nTarget--) {
-            int32_t v = m_stream->get16() * volume;
-            *target++ = v;
-            *target++ = v;
+        m_pos += nTarget;
+        static const int CHUNK = 32;
+        int16_t buf[CHUNK * 2];
+        while (nTarget) {
+            int n = wMin(int(nTarget), CHUNK);
+            m_stream->read((uint8_t*)buf, n * 2 * m_channels);
+            if (m_channels == 2)
+                scaleRaw<2, ADD>(buf, n, volume, target);
+            else
+                scaleRaw<1, ADD>(buf, n, volume, target);
+            advance(volume, n);
+            target += n * 2;
+            nTarget -= n;
         }
     }
+    else if (m_channels == 2) {
+        if (m_checked)
+            expandStereo<int32_t, ADD, true>(target, nTarget, volume);
+        else
+            expandStereo<int32_t, ADD, false>(target, nTarget, volume);
+    }
     else {
-        innerLinearExpand<int32_t, 2>(m_bitReader, m_context, m_shiftBits, target, nTarget, volume);
+        if (m_checked)
+            expandLinear<int32_t, 2, ADD, true>(target, nTarget, volume);
+        else
+            expandLinear<int32_t, 2, ADD, false>(target, nTarget, volume);
     }
 }
 
 
+template<bool ADD>
+void Expander::expand2(int32_t* target, uint32_t nTarget, int32_t volume)
+{
+    expandTo32<ADD>(target, nTarget, volume);
+}
+
+
+template<bool ADD>
+void Expander::expand2(int32_t* target, uint32_t nTarget, int32_t volumeStart, int32_t volumeEnd)
+{
+    expandTo32<ADD>(target, nTarget, volumeRamp(nTarget, volumeStart, volumeEnd));
+}
+
+
+template void Expander::expand2<false>(int32_t* target, uint32_t nTarget, int32_t volume);
+template void Expander::expand2<true>(int32_t* target, uint32_t nTarget, int32_t volume);
+template void Expander::expand2<false>(int32_t* target, uint32_t nTarget, int32_t volumeStart, int32_t volumeEnd);
+template void Expander::expand2<true>(int32_t* target, uint32_t nTarget, int32_t volumeStart, int32_t volumeEnd);
+
+
+void Expander::setStep(uint32_t step, int interpolation)
+{
+    assert(step > 0);
+    m_step = step;
+    m_interpolation = interpolation;
+}
+
+
+// The next source frame, decoded a chunk at a time; silence past the end.
+void Expander::nextFrame(int16_t* frame)
+{
+    if (m_chunkPos == m_chunkLen) {
+        uint32_t n = m_looping ? RESAMPLE_CHUNK : wMin(uint32_t(RESAMPLE_CHUNK), m_nSamples - m_pos);
+        if (n == 0) {
+            frame[0] = frame[1] = 0;
+            return;
+        }
+        expand(m_chunk, n);
+        m_chunkPos = 0;
+        m_chunkLen = int(n);
+    }
+    const int16_t* src = m_chunk + m_chunkPos * m_channels;
+    frame[0] = src[0];
+    frame[1] = src[m_channels - 1];
+    ++m_chunkPos;
+}
+
+
+// 'f' is the fraction of the way from p1 to p2, in 15 bits.
+static inline int32_t interpolateLinear(int32_t p1, int32_t p2, int32_t f)
+{
+    return p1 + (((p2 - p1) * f) >> 15);
+}
+
+// Catmull-Rom through p0..p3, between p1 and p2. The intermediate terms
+// don't fit 32 bits.
+static inline int32_t interpolateCubic(int32_t p0, int32_t p1, int32_t p2, int32_t p3, int32_t f)
+{
+    int64_t a = 3 * (p1 - p2) + p3 - p0;
+    int64_t b = 2 * p0 - 5 * p1 + 4 * p2 - p3;
+    int64_t c = p2 - p0;
+    int64_t v = ((a * f) >> 15) + b;
+    v = ((v * f) >> 15) + c;
+    v = (v * f) >> 16;
+    return int32_t(wMax(int64_t(-32768), wMin(int64_t(32767), p1 + v)));
+}
+
+
+template<bool ADD, int INTERPOLATION, typename V>
+uint32_t Expander::resampleTo32(int32_t* target, uint32_t nTarget, V volume)
+{
+    if (!m_primed) {
+        // Before the position is taken to be the same as it.
+        m_chunkPos = m_chunkLen = 0;
+        m_framePos = m_pos;
+        m_phase = 0;
+        nextFrame(m_frames[1]);
+        nextFrame(m_frames[2]);
+        nextFrame(m_frames[3]);
+        m_frames[0][0] = m_frames[1][0];
+        m_frames[0][1] = m_frames[1][1];
+        m_primed = true;
+    }
+
+    uint32_t nSource = 0;
+    for (uint32_t i = 0; i < nTarget; ++i) {
+        if (m_looping || m_framePos < m_nSamples)
+            ++nSource;
+        const int32_t f = int32_t(m_phase >> 1);
+        int32_t s[2];
+        for (int c = 0; c < 2; ++c) {
+            if (INTERPOLATION == INTERPOLATE_CUBIC)
+                s[c] = interpolateCubic(m_frames[0][c], m_frames[1][c], m_frames[2][c], m_frames[3][c], f);
+            else
+                s[c] = interpolateLinear(m_frames[1][c], m_frames[2][c], f);
+        }
+        const int32_t v = volumeAt(volume, 0);
+        advance(volume, 1);
+        if (ADD) {
+            target[0] += s[0] * v;
+            target[1] += s[1] * v;
+        }
+        else {
+            target[0] = s[0] * v;
+            target[1] = s[1] * v;
+        }
+        target += 2;
+
+        for (m_phase += m_step; m_phase >= STEP_ONE; m_phase -= STEP_ONE) {
+            memmove(m_frames[0], m_frames[1], sizeof(m_frames[0]) * 3);
+            nextFrame(m_frames[3]);
+            ++m_framePos;
+        }
+    }
+    return nSource;
+}
+
+
+template<bool ADD>
+uint32_t Expander::expandResampled(int32_t* target, uint32_t nTarget, int32_t volume)
+{
+    if (m_interpolation == INTERPOLATE_CUBIC)
+        return resampleTo32<ADD, INTERPOLATE_CUBIC>(target, nTarget, volume);
+    return resampleTo32<ADD, INTERPOLATE_LINEAR>(target, nTarget, volume);
+}
+
+
+template<bool ADD>
+uint32_t Expander::expandResampled(int32_t* target, uint32_t nTarget, int32_t volumeStart, int32_t volumeEnd)
+{
+    VolumeRamp ramp = volumeRamp(nTarget, volumeStart, volumeEnd);
+    if (m_interpolation == INTERPOLATE_CUBIC)
+        return resampleTo32<ADD, INTERPOLATE_CUBIC>(target, nTarget, ramp);
+    return resampleTo32<ADD, INTERPOLATE_LINEAR>(target, nTarget, ramp);
+}
+
+
+template uint32_t Expander::expandResampled<false>(int32_t* target, uint32_t nTarget, int32_t volume);
+template uint32_t Expander::expandResampled<true>(int32_t* target, uint32_t nTarget, int32_t volume);
+template uint32_t Expander::expandResampled<false>(int32_t* target, uint32_t nTarget, int32_t volumeStart, int32_t volumeEnd);
+template uint32_t Expander::expandResampled<true>(int32_t* target, uint32_t nTarget, int32_t volumeStart, int32_t volumeEnd);
+
+
 void CompressStat::consolePrint() const
 {
     for (int b = 0; b < 16; ++b) {
@@ -172,5 +1807,28 @@ void CompressStat::consolePrint() const
             buckets[b]);
     }
     printf("edgeWrites=%d\n", edgeWrites);
+    for (int p = 0; p < Wav12Header::NUM_PREDICTORS; ++p) {
+        if (predictors[p])
+            printf("predictor order %d: %d blocks\n", p, predictors[p]);
+    }
+    for (int k = 0; k < 16; ++k) {
+        if (riceParams[k])
+            printf("rice param %d: %d blocks\n", k, riceParams[k]);
+    }
+    if (runs)
+        printf("runs=%d samples=%d\n", runs, runSamples);
+    static const char* STEREO_NAMES[4] = { "left/right", "left/side", "side/right", "mid/side" };
+    for (int m = 0; m < 4; ++m) {
+        if (stereoModes[m])
+            printf("stereo %s: %d blocks\n", STEREO_NAMES[m], stereoModes[m]);
+    }
     printf("shift bits=%d\n", shift);
+    if (autoShift) {
+        for (int i = 0; i <= MAX_SHIFT; ++i) {
+            printf("auto shift=%d size=%d snr=%.1f%s\n", i, autoSize[i], autoSNR[i],
+                i == 0 ? " (lossless)" : "");
+        }
+        printf("auto chose shift=%d for snr>=%.1f: max error=%d rms error=%.2f snr=%.1f\n",
+            shift, minSNR, maxError, rmsError, snr);
+    }
 }
@@ -13,14 +13,80 @@ namespace wav12 {
     template<class T>
     T wMin(const T& a, const T& b) { return a < b ? a : b; }
 
+    template<class T>
+    T wMax(const T& a, const T& b) { return a > b ? a : b; }
+
+    // Optional, one per block and channel: the state needed to start
+    // decoding there.
+    struct SeekEntry
+    {
+        uint32_t bitOffset;     // from the start of the bitstream
+        int16_t prev[3];        // Context::prev1, prev2, prev3 of the left (or mono), right channel
+        int16_t unused;
+    };
+
     struct Wav12Header
     {
+        enum {
+            FORMAT_RAW = 0,             // 16 bit samples
+            FORMAT_LINEAR = 1,          // 4 bit length, sign, magnitude
+            FORMAT_RICE = 2,            // Rice codes, 4 bit parameter at the start of each block
+        };
+        enum {
+            FLAG_SEEK_TABLE = 0x01,     // SeekEntry per block, after the header
+            FLAG_PREDICTOR  = 0x02,     // 2 bit predictor order at the start of each block
+            FLAG_RUNS       = 0x04,     // format 1 only: runs of zero residuals are escaped
+            FLAG_STEREO     = 0x08,     // interleaved left/right, any format
+            FLAG_RATE       = 0x10,     // uint32_t sample rate after the header, any format
+        };
+        // Stereo blocks start with a 2 bit mode: which pair of channels is coded.
+        enum {
+            STEREO_LR = 0,              // left, right
+            STEREO_LS = 1,              // left, side (left - right)
+            STEREO_SR = 2,              // side, right
+            STEREO_MS = 3,              // mid ((left + right) / 2), side
+        };
+        static const int DEFAULT_RATE = 22050;     // without FLAG_RATE
+        static const int DEFAULT_BLOCK_SHIFT = 10;
+        static const int NUM_PREDICTORS = 4;
+
         char id[4];             // 'wv12'
-        uint32_t lenInBytes;    // after header, compressed size
-        uint32_t nSamples;
-        uint8_t  format;        // 0 uncompressed, 1 compressed
+        uint32_t lenInBytes;    // after header, compressed size (including tables)
+        uint32_t nSamples;      // per channel
+        uint8_t  format;        // FORMAT_*: 0 uncompressed, 1 and 2 compressed
         uint8_t  shiftBits;     // only if compressed
-        uint8_t  unused[2];
+        uint8_t  flags;         // FLAG_*, only if compressed (except FLAG_STEREO, FLAG_RATE)
+        uint8_t  blockShift;    // block is (1 << blockShift) samples
+
+        int channels() const {
+            return (flags & FLAG_STEREO) ? 2 : 1;
+        }
+        bool usesBlocks() const {
+            return format != FORMAT_RAW
+                && ((flags & (FLAG_SEEK_TABLE | FLAG_PREDICTOR | FLAG_STEREO)) || format == FORMAT_RICE);
+        }
+        uint32_t nBlocks() const {
+            return (nSamples + (1 << blockShift) - 1) >> blockShift;
+        }
+        uint32_t seekTableSize() const {
+            return (flags & FLAG_SEEK_TABLE) ? nBlocks() * channels() * sizeof(SeekEntry) : 0;
+        }
+        // Optional fields between the header and the seek table.
+        uint32_t extSize() const {
+            return (flags & FLAG_RATE) ? 4 : 0;
+        }
+        // Offset of the bitstream (or raw samples) from the end of the header.
+        uint32_t dataOffset() const {
+            return extSize() + seekTableSize();
+        }
+        // The fields the decoder depends on are in range. The bitstream
+        // itself can't overrun (it reads as 0 bits past the end), so
+        // this is all the Expander checks before its unchecked loops.
+        bool valid() const {
+            return format <= FORMAT_RICE
+                && shiftBits < 16
+                && (!usesBlocks() || (blockShift > 0 && blockShift < 32));
+        }
     };
 
     struct CompressStat
@@ -31,6 +97,22 @@ namespace wav12 {
         int buckets[16] = { 0 };
         int edgeWrites = 0;
         int shift = 0;
+        int predictors[Wav12Header::NUM_PREDICTORS] = { 0 };   // blocks per predictor order
+        int riceParams[16] = { 0 };                             // blocks per Rice parameter
+        int runs = 0;                                           // FLAG_RUNS: escaped runs
+        int runSamples = 0;                                     // and the samples in them
+        int stereoModes[4] = { 0 };                             // blocks per Wav12Header::STEREO_*
+
+        // Filled in by linearCompressAuto: the error of the chosen shift,
+        // and the size and SNR of every shift that was tried.
+        static const int MAX_SHIFT = 4;
+        bool autoShift = false;
+        float minSNR = 0;
+        int maxError = 0;
+        float rmsError = 0;
+        float snr = 0;                      // dB, 0 if lossless
+        int autoSize[MAX_SHIFT + 1] = { 0 };
+        float autoSNR[MAX_SHIFT + 1] = { 0 };
 
         void consolePrint() const;
     };
@@ -40,6 +122,7 @@ namespace wav12 {
         uint32_t prev1 = 0;
         uint32_t prev2 = 0;
         uint32_t prev3 = 0;
+        uint32_t run = 0;       // zero residuals left in the current run
     };
 
     void linearCompress(const int16_t* data, int32_t nSamples,
@@ -47,10 +130,44 @@ namespace wav12 {
         int shiftBits = 0,
         CompressStat* stats = 0);
 
+    // Compresses with the layout described by the header (format,
+    // shiftBits, flags, blockShift). Fills in the rest of the header;
+    // 'compressed' is everything that follows the header. With
+    // FLAG_STEREO, 'data' is nSamples interleaved left/right pairs.
+    // The extension fields (extSize() bytes) are zero, for the caller
+    // to fill in.
+    void linearCompress(const int16_t* data, int32_t nSamples,
+        uint8_t** compressed, Wav12Header* header,
+        CompressStat* stats = 0);
+
+    // The most linearCompress can write for nSamples with the layout of
+    // 'layout' (format, flags, blockShift): everything after the header,
+    // tables included. The second is the format 1 stream of the first
+    // linearCompress.
+    uint32_t maxCompressedSize(int32_t nSamples, const Wav12Header& layout);
+    uint32_t maxCompressedSize(int32_t nSamples);
+
+    // As above, into the caller's buffer of 'size' bytes, which must be
+    // at least maxCompressedSize().
+    void linearCompress(const int16_t* data, int32_t nSamples,
+        uint8_t* compressed, uint32_t size, Wav12Header* header,
+        CompressStat* stats = 0);
+
+    // As above, but the bitstream is written to 'out' through a fixed
+    // size buffer, so the compressed data is never held in memory. The
+    // header can't have FLAG_SEEK_TABLE; the caller writes the header
+    // and the extension fields before the bitstream.
+    void linearCompress(const int16_t* data, int32_t nSamples,
+        IOutStream* out, Wav12Header* header,
+        CompressStat* stats = 0);
+
     void linearExpand(const uint8_t* compressed, int32_t nCompressed,
         int16_t* data, int32_t nSamples,
         int shiftBits = 0);
 
+    void linearExpand(const Wav12Header& header, const uint8_t* compressed,
+        int16_t* data);
+
     class MemStream : public wav12::IStream
     {
     public:
@@ -73,6 +190,24 @@ namespace wav12 {
             return (int16_t)v;
         }
 
+        int read(uint8_t* dst, int n) {
+            n = wMin(n, int(m_mem + m_nBytes - m_ptr));
+            memcpy(dst, m_ptr, n);
+            m_ptr += n;
+            return n;
+        }
+
+        bool seek(uint32_t pos) {
+            assert(pos <= uint32_t(m_nBytes));
+            m_ptr = m_mem + pos;
+            return true;
+        }
+
+        const uint8_t* window(uint32_t* nBytes) {
+            *nBytes = uint32_t(m_mem + m_nBytes - m_ptr);
+            return m_ptr;
+        }
+
         int32_t size() const { return m_nBytes; }
         int32_t pos() { return int32_t(m_ptr - m_mem); }
 
@@ -89,26 +224,55 @@ namespace wav12 {
         ChunkStream(uint8_t* subBuffer, int subBufferSize) {
             m_subBuffer = subBuffer;
             m_subBufferSize = subBufferSize;
-            m_subBufferPos = m_subBufferSize;   // buffer is empty
+            emptySubBuffer();
         }
         
         uint8_t get() {
-            if (m_subBufferPos == m_subBufferSize) fillSubBuffer();
+            if (m_subBufferPos == m_subBufferLen) refillSubBuffer();
+            assert(m_subBufferPos < m_subBufferLen);
             return m_subBuffer[m_subBufferPos++];
         }
 
         int16_t get16() {
-            if (m_subBufferPos == m_subBufferSize) fillSubBuffer();
+            if (m_subBufferPos == m_subBufferLen) refillSubBuffer();
+            assert(m_subBufferPos + 1 < m_subBufferLen);
             uint16_t v = m_subBuffer[m_subBufferPos] + m_subBuffer[m_subBufferPos + 1] * 256;
             m_subBufferPos += 2;
             return (int16_t)v;
         }
 
-        virtual void fillSubBuffer() = 0;
+        // Short only at the end of the stream, when fillSubBuffer()
+        // has nothing more.
+        int read(uint8_t* dst, int n) {
+            int nRead = 0;
+            while (nRead < n) {
+                if (m_subBufferPos == m_subBufferLen && !refillSubBuffer())
+                    break;
+                int nCopy = wMin(n - nRead, m_subBufferLen - m_subBufferPos);
+                memcpy(dst + nRead, m_subBuffer + m_subBufferPos, nCopy);
+                m_subBufferPos += nCopy;
+                nRead += nCopy;
+            }
+            return nRead;
+        }
+
+        // Fills the sub-buffer (up to m_subBufferSize) from its start.
+        // Returns the bytes put there: 0 at the end of the stream.
+        virtual int fillSubBuffer() = 0;
 
     protected:
+        // For seek() in sub-classes: the next read will call fillSubBuffer().
+        void emptySubBuffer() { m_subBufferPos = m_subBufferLen = 0; }
+
+        int refillSubBuffer() {
+            m_subBufferLen = fillSubBuffer();
+            m_subBufferPos = 0;
+            return m_subBufferLen;
+        }
+
         uint8_t* m_subBuffer;
         int m_subBufferSize;
+        int m_subBufferLen;     // filled
         int m_subBufferPos;
     };
 
@@ -120,28 +284,221 @@ namespace wav12 {
         Expander(IStream* stream, uint32_t nSamples, int format, int shiftBits);
         void init(IStream* stream, uint32_t nSamples, int format, int shiftBits);
 
+        // The stream starts at the data after the header.
+        Expander(IStream* stream, const Wav12Header& header);
+        void init(IStream* stream, const Wav12Header& header);
+
         // Expand to the target buffer with a length of nTarget.
         // Returns number of samples actually expanded.
+        // Stereo streams write nTarget interleaved left/right pairs.
         void expand(int16_t* target, uint32_t nTarget);
 
-        // Does a stereo expansion (both channels the same, of course)
-        // to 32 bits. nTarget is the samples per channel.
+        // Does a stereo expansion to 32 bits: mono is written to
+        // both channels. nTarget is the samples per channel.
         // Volume max is 65536
+        // With ADD, the samples are added to the target rather than
+        // written over it, so streams can be mixed without a buffer
+        // each (see Mixer).
+        template<bool ADD = false>
         void expand2(int32_t* target, uint32_t nTarget, int32_t volume);
 
-        bool done() const { return m_nSamples == m_pos; }
+        // As above, with the volume ramped from volumeStart at the
+        // first frame toward volumeEnd, which the frame after the last
+        // would have, so a fade over several calls is seamless. The
+        // ramp is applied as the samples are decoded, in fixed point.
+        template<bool ADD = false>
+        void expand2(int32_t* target, uint32_t nTarget, int32_t volumeStart, int32_t volumeEnd);
+
+        // Resampling, for pitch changes: 'step' is source frames per
+        // output frame, in 16.16 fixed point (STEP_ONE plays at the
+        // recorded rate, 2 * STEP_ONE an octave up). Source frames are
+        // decoded as the output needs them, a few at a time.
+        enum {
+            INTERPOLATE_LINEAR,
+            INTERPOLATE_CUBIC,      // Catmull-Rom
+        };
+        static const uint32_t STEP_ONE = 1 << 16;
+        void setStep(uint32_t step, int interpolation = INTERPOLATE_LINEAR);
+        uint32_t step() const { return m_step; }
+        // expandResampled() has decoded ahead of pos().
+        bool resampling() const { return m_primed; }
+
+        // As expand2, but nTarget frames resampled by the step. Past
+        // the end the source reads as silence. Returns the frames that
+        // come from the source: less than nTarget at the end. Don't
+        // mix with expand() and expand2() without a seek() between.
+        template<bool ADD = false>
+        uint32_t expandResampled(int32_t* target, uint32_t nTarget, int32_t volume);
+        template<bool ADD = false>
+        uint32_t expandResampled(int32_t* target, uint32_t nTarget, int32_t volumeStart, int32_t volumeEnd);
+
+        // Moves the read position to 'sample'. Needs a stream that
+        // supports seek(). With a seek table this jumps to the block
+        // and decodes at most a block of samples, else it decodes
+        // from the start (or the current position) of the stream.
+        // Returns false if the stream can't seek.
+        bool seek(uint32_t sample);
+
+        // Loops from 'end' (0 for the end of the stream) back to
+        // 'start', inside expand(), expand2() and expandResampled(), so
+        // the output runs on across the join; there is no end and
+        // done() is never true. The decoder state at 'start' is kept
+        // as it's decoded through, so a wrap is a copy rather than a
+        // seek. Needs a stream that supports seek(): returns false, and
+        // doesn't loop, if it can't. (Should a seek fail at the wrap
+        // anyway, the sound ends there, and the rest is silence.)
+        bool setLoop(uint32_t start = 0, uint32_t end = 0);
+        void clearLoop() { m_looping = false; }
+        bool looping() const { return m_looping; }
+        uint32_t loopStart() const { return m_loopStart; }
+        uint32_t loopEnd() const { return m_loopEnd; }
+
+        // By default the stream is trusted once the header checks out
+        // (see Wav12Header::valid()), and decoding has no asserts per
+        // bit or sample. A checked Expander keeps them, for debugging
+        // a stream or the codec.
+        void setChecked(bool checked) { m_checked = checked; }
+        bool checked() const { return m_checked; }
+
+        bool done() const { return !m_looping && m_nSamples == m_pos; }
         
         uint32_t samples() const { return m_nSamples; }
         uint32_t pos() const     { return m_pos; }
+        uint32_t rate() const    { return m_rate; }
 
     private:
         IStream* m_stream;
         uint32_t m_nSamples;
         uint32_t m_pos;
-        Context m_context;
+        Context m_context[2];       // per coded channel
         int m_format;
         int m_shiftBits;
+        int m_flags;
+        int m_blockShift;
+        uint32_t m_tableOffset;
+        uint32_t m_dataOffset;
+        uint32_t m_rate;
+        int m_channels;
+        int m_stereoMode;
+        int m_predictor[2];
+        int m_riceParam[2];
+        bool m_checked;
         BitReader m_bitReader;
+        uint32_t m_bitBase;         // where m_bitReader was started
+        uint32_t m_dataEnd;         // of the bitstream, in the stream
+
+        // The decoder at the loop start, once it's been decoded to.
+        struct LoopMark
+        {
+            BitReader bitReader;
+            uint32_t bitBase;
+            Context context[2];
+            int stereoMode;
+            int predictor[2];
+            int riceParam[2];
+        };
+        bool m_looping;
+        bool m_marked;
+        uint32_t m_loopStart;
+        uint32_t m_loopEnd;
+        LoopMark m_mark;
+
+        // Resampling: the source frames around the position (p - 1,
+        // p, p + 1, p + 2), and the decoded frames after them.
+        static const int RESAMPLE_CHUNK = 16;
+        uint32_t m_step;
+        int m_interpolation;
+        bool m_primed;              // m_frames is filled
+        uint32_t m_phase;           // from p to p + 1, 16 bits
+        uint32_t m_framePos;        // p
+        int16_t m_frames[4][2];     // left, right
+        int16_t m_chunk[RESAMPLE_CHUNK * 2];
+        int m_chunkPos;
+        int m_chunkLen;
+
+        bool seekSample(uint32_t sample);
+        void startBits(uint32_t offset);
+        void skip(uint32_t n);
+        void setStereoMode(int mode);
+
+        // Samples to decode before the loop start is marked or the end
+        // wraps; loopPoint() does either when it's time. It returns
+        // false if a wrap couldn't seek.
+        uint32_t toLoopPoint() const;
+        bool loopPoint();
+        void expandSamples(int16_t* target, uint32_t nTarget);
+        template<bool ADD, typename V>
+        void expandSamplesTo32(int32_t* target, uint32_t nTarget, V volume);
+
+        // V is the volume: a constant or a ramp.
+        template<bool ADD, typename V>
+        void expandTo32(int32_t* target, uint32_t nTarget, V volume);
+
+        void nextFrame(int16_t* frame);
+
+        template<bool ADD, int INTERPOLATION, typename V>
+        uint32_t resampleTo32(int32_t* target, uint32_t nTarget, V volume);
+
+        template<typename T, int CHANNELS, bool ADD, bool CHECKED, typename V>
+        void expandLinear(T* target, uint32_t nTarget, V volume);
+
+        template<typename T, bool ADD, bool CHECKED, typename V>
+        void expandStereo(T* target, uint32_t nTarget, V volume);
+    };
+
+
+    // The mirror of Expander: samples are pushed in chunks of any size,
+    // and the bitstream is written as they are coded. At most a block
+    // (or, without blocks, about 128k samples) is held at a time. The
+    // header gives the layout, as for linearCompress.
+    class Compressor
+    {
+    public:
+        // Writes to 'out' through a small buffer. There is no seek table,
+        // since it comes before the bitstream.
+        Compressor(IOutStream* out, const Wav12Header& header, CompressStat* stats = 0);
+        // Writes to 'compressed', which has room for 'size' bytes. With
+        // FLAG_SEEK_TABLE, the entries go to 'seekTable', which has room
+        // for every block.
+        Compressor(uint8_t* compressed, int size, uint8_t* seekTable,
+            const Wav12Header& header, CompressStat* stats = 0);
+        ~Compressor();
+
+        // nSamples per channel; interleaved left/right with FLAG_STEREO.
+        void push(const int16_t* data, uint32_t nSamples);
+
+        // Codes what is left, and writes the end of the bitstream. The
+        // header is filled in (nSamples, lenInBytes) as linearCompress
+        // does.
+        void finish(Wav12Header* header);
+
+        uint32_t samples() const { return m_nSamples; }
+
+    private:
+        Compressor(const Compressor&) = delete;
+        Compressor& operator=(const Compressor&) = delete;
+
+        static const int BUFFER_SIZE = 4096;
+
+        Wav12Header m_header;
+        CompressStat* m_stats;
+        uint8_t* m_seekTable;
+        uint32_t m_nSamples;        // pushed
+        uint32_t m_nBlocks;         // coded
+        int m_step;                 // samples coded at a time
+        int m_window;               // and held, to look ahead
+        int16_t* m_pending;         // m_window samples
+        int m_nPending;
+        int32_t* m_split[4];        // left (or mono), right, mid, side
+        int32_t* m_resid[2];        // residuals of the coded channels
+        uint8_t* m_widths[2];       // and their sizes (format 1)
+        int32_t* m_scratch;         // residuals being weighed
+        Context m_context[2];       // per channel (left, right)
+        uint8_t m_buffer[BUFFER_SIZE];
+        BitWriter m_writer;
+
+        void init(const Wav12Header& header, uint8_t* seekTable, CompressStat* stats);
+        void code(const int16_t* src, int n, int nLook);
     };
 }
 #endif
@@ -0,0 +1,264 @@
+#include "mixer.h"
+
+#include <math.h>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WAV12_MIXER_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define WAV12_MIXER_NEON
+#include <arm_neon.h>
+#endif
+
+using namespace wav12;
+
+// The bus back to 16 bits, saturated.
+static void clipBus(const int32_t* bus, int n, int16_t* out)
+{
+    int i = 0;
+#if defined(WAV12_MIXER_SSE2)
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(bus + i)), Mixer::VOLUME_SHIFT);
+        __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(bus + i + 4)), Mixer::VOLUME_SHIFT);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(a, b));
+    }
+#elif defined(WAV12_MIXER_NEON)
+    for (; i + 8 <= n; i += 8) {
+        int16x4_t a = vqmovn_s32(vshrq_n_s32(vld1q_s32(bus + i), Mixer::VOLUME_SHIFT));
+        int16x4_t b = vqmovn_s32(vshrq_n_s32(vld1q_s32(bus + i + 4), Mixer::VOLUME_SHIFT));
+        vst1q_s16(out + i, vcombine_s16(a, b));
+    }
+#endif
+    for (; i < n; ++i) {
+        int32_t v = bus[i] >> Mixer::VOLUME_SHIFT;
+        out[i] = int16_t(wMax(-32768, wMin(32767, v)));
+    }
+}
+
+
+// Adds n frames of a voice to the bus, with the volume going from
+// volumeStart toward volumeEnd. Returns false once the voice is done.
+static bool addVoice(Expander* expander, int32_t* bus, uint32_t n, int32_t volumeStart, int32_t volumeEnd)
+{
+    if (expander->step() != Expander::STEP_ONE || expander->resampling()) {
+        uint32_t k = 0;
+        if (volumeStart == volumeEnd)
+            k = expander->expandResampled<true>(bus, n, volumeStart);
+        else
+            k = expander->expandResampled<true>(bus, n, volumeStart, volumeEnd);
+        return k == n;
+    }
+    uint32_t k = expander->looping() ? n : wMin(n, expander->samples() - expander->pos());
+    if (volumeStart == volumeEnd)
+        expander->expand2<true>(bus, k, volumeStart);
+    else
+        expander->expand2<true>(bus, k, volumeStart, volumeEnd);
+    return !expander->done();
+}
+
+
+Mixer::Mixer()
+{
+    for (int i = 0; i < MAX_VOICES; ++i) {
+        m_voices[i].expander = 0;
+        m_voices[i].volume = 0;
+        m_voices[i].target = 0;
+        m_voices[i].rampLeft = 0;
+    }
+}
+
+
+int Mixer::play(Expander* expander, int32_t volume)
+{
+    assert(expander);
+    for (int i = 0; i < MAX_VOICES; ++i) {
+        if (!m_voices[i].expander) {
+            m_voices[i].expander = expander;
+            m_voices[i].volume = volume;
+            m_voices[i].target = volume;
+            m_voices[i].rampLeft = 0;
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+void Mixer::stop(int voice)
+{
+    assert(voice >= 0 && voice < MAX_VOICES);
+    m_voices[voice].expander = 0;
+}
+
+
+void Mixer::setVolume(int voice, int32_t volume)
+{
+    assert(voice >= 0 && voice < MAX_VOICES);
+    m_voices[voice].target = volume;
+    m_voices[voice].rampLeft = BUS_FRAMES;
+}
+
+
+int Mixer::numPlaying() const
+{
+    int n = 0;
+    for (int i = 0; i < MAX_VOICES; ++i) {
+        if (m_voices[i].expander)
+            ++n;
+    }
+    return n;
+}
+
+
+void Mixer::mix(int16_t* out, uint32_t nFrames)
+{
+    while (nFrames) {
+        const uint32_t n = wMin(nFrames, uint32_t(BUS_FRAMES));
+        memset(m_bus, 0, n * 2 * sizeof(int32_t));
+
+        for (int i = 0; i < MAX_VOICES; ++i) {
+            Voice& voice = m_voices[i];
+            Expander* expander = voice.expander;
+            if (!expander)
+                continue;
+            // A voice that ends part way through adds silence after.
+            // The part of a ramp that falls in this piece goes first.
+            bool playing = true;
+            const uint32_t nRamp = wMin(n, voice.rampLeft);
+            if (nRamp) {
+                int32_t end = voice.volume + int32_t(int64_t(voice.target - voice.volume) * nRamp / voice.rampLeft);
+                playing = addVoice(expander, m_bus, nRamp, voice.volume, end);
+                voice.volume = end;
+                voice.rampLeft -= nRamp;
+            }
+            if (playing && n > nRamp)
+                playing = addVoice(expander, m_bus + nRamp * 2, n - nRamp, voice.volume, voice.volume);
+            if (!playing)
+                voice.expander = 0;
+        }
+
+        clipBus(m_bus, int(n * 2), out);
+        out += n * 2;
+        nFrames -= n;
+    }
+}
+
+
+#define TEST_TRUE(x) \
+    if (!(x)) return false;
+
+/*static*/ bool Mixer::Test()
+{
+    const double PI = 3.14159265358979323846;
+    const int N_LONG = 2000;
+    const int N_SHORT = 700;
+
+    // A loud mono tone (format 1), a stereo chord (Rice), and raw noise,
+    // each with the samples they decode to.
+    std::vector<int16_t> tone(N_LONG);
+    std::vector<int16_t> chord(N_SHORT * 2);
+    std::vector<int16_t> noise(N_LONG);
+    uint32_t seed = 1;
+    for (int i = 0; i < N_LONG; ++i) {
+        tone[i] = int16_t(30000 * sin(2 * PI * i / 80));
+        seed = seed * 1664525 + 1013904223;
+        noise[i] = int16_t(seed >> 16);
+    }
+    for (int i = 0; i < N_SHORT; ++i) {
+        chord[i * 2] = int16_t(12000 * sin(2 * PI * i / 50));
+        chord[i * 2 + 1] = int16_t(12000 * sin(2 * PI * i / 33));
+    }
+
+    Wav12Header toneHeader;
+    memset(&toneHeader, 0, sizeof(toneHeader));
+    toneHeader.format = Wav12Header::FORMAT_LINEAR;
+    toneHeader.flags = Wav12Header::FLAG_PREDICTOR | Wav12Header::FLAG_RUNS;
+    uint8_t* toneData = 0;
+    linearCompress(&tone[0], N_LONG, &toneData, &toneHeader);
+
+    Wav12Header chordHeader;
+    memset(&chordHeader, 0, sizeof(chordHeader));
+    chordHeader.format = Wav12Header::FORMAT_RICE;
+    chordHeader.flags = Wav12Header::FLAG_STEREO | Wav12Header::FLAG_PREDICTOR;
+    uint8_t* chordData = 0;
+    linearCompress(&chord[0], N_SHORT, &chordData, &chordHeader);
+
+    Wav12Header noiseHeader;
+    memset(&noiseHeader, 0, sizeof(noiseHeader));
+    noiseHeader.nSamples = N_LONG;
+    noiseHeader.lenInBytes = N_LONG * 2;
+
+    MemStream toneStream(toneData, toneHeader.lenInBytes);
+    MemStream chordStream(chordData, chordHeader.lenInBytes);
+    MemStream noiseStream((const uint8_t*)&noise[0], N_LONG * 2);
+    Expander toneExpander(&toneStream, toneHeader);
+    Expander chordExpander(&chordStream, chordHeader);
+    Expander noiseExpander(&noiseStream, noiseHeader);
+
+    const int32_t TONE_VOLUME = VOLUME_UNITY;
+    const int32_t CHORD_VOLUME = VOLUME_UNITY * 3 / 4;
+    const int32_t NOISE_VOLUME = VOLUME_UNITY / 8;
+    Mixer mixer;
+    int toneVoice = mixer.play(&toneExpander, TONE_VOLUME);
+    int chordVoice = mixer.play(&chordExpander, CHORD_VOLUME);
+    int noiseVoice = mixer.play(&noiseExpander, NOISE_VOLUME);
+    TEST_TRUE(toneVoice >= 0 && chordVoice >= 0 && noiseVoice >= 0);
+    TEST_TRUE(mixer.numPlaying() == 3);
+
+    // Uneven pieces, across the bus size and the end of the chord,
+    // and on past the end of everything.
+    const int N_OUT = N_LONG + 100;
+    std::vector<int16_t> out(N_OUT * 2);
+    for (int i = 0; i < N_OUT; ) {
+        int n = wMin(N_OUT - i, 1 + (i * 7) % 600);
+        mixer.mix(&out[i * 2], n);
+        i += n;
+    }
+    TEST_TRUE(mixer.numPlaying() == 0);
+    TEST_TRUE(!mixer.playing(chordVoice));
+
+    std::vector<int16_t> toneRef(N_LONG);
+    std::vector<int16_t> chordRef(N_SHORT * 2);
+    linearExpand(toneHeader, toneData, &toneRef[0]);
+    linearExpand(chordHeader, chordData, &chordRef[0]);
+    bool clipped = false;
+    for (int i = 0; i < N_OUT; ++i) {
+        for (int c = 0; c < 2; ++c) {
+            int32_t sum = 0;
+            if (i < N_LONG)
+                sum += toneRef[i] * TONE_VOLUME + noise[i] * NOISE_VOLUME;
+            if (i < N_SHORT)
+                sum += chordRef[i * 2 + c] * CHORD_VOLUME;
+            int32_t v = sum >> VOLUME_SHIFT;
+            clipped |= v > 32767 || v < -32768;
+            TEST_TRUE(out[i * 2 + c] == wMax(-32768, wMin(32767, v)));
+        }
+    }
+    TEST_TRUE(clipped);
+
+    // A volume change is ramped over BUS_FRAMES of output, however small
+    // the pieces: a steady level fades out in a straight line.
+    std::vector<int16_t> level(BUS_FRAMES * 2, 8000);
+    Wav12Header levelHeader;
+    memset(&levelHeader, 0, sizeof(levelHeader));
+    levelHeader.nSamples = BUS_FRAMES * 2;
+    levelHeader.lenInBytes = BUS_FRAMES * 4;
+    MemStream levelStream((const uint8_t*)&level[0], BUS_FRAMES * 4);
+    Expander levelExpander(&levelStream, levelHeader);
+    int levelVoice = mixer.play(&levelExpander);
+    mixer.setVolume(levelVoice, 0);
+    std::vector<int16_t> fade(BUS_FRAMES * 2 * 2);
+    for (int i = 0; i < BUS_FRAMES * 2; i += 10)
+        mixer.mix(&fade[i * 2], wMin(10, BUS_FRAMES * 2 - i));
+    for (int i = 0; i < BUS_FRAMES * 2; ++i) {
+        int expected = i < BUS_FRAMES ? 8000 * (BUS_FRAMES - i) / BUS_FRAMES : 0;
+        int d = fade[i * 2] - expected;
+        TEST_TRUE(d >= -4 && d <= 4);
+        TEST_TRUE(fade[i * 2 + 1] == fade[i * 2]);
+    }
+
+    delete[] toneData;
+    delete[] chordData;
+    return true;
+}
@@ -0,0 +1,58 @@
+#ifndef WAV12_MIXER_INCLUDED
+#define WAV12_MIXER_INCLUDED
+
+#include "compress.h"
+
+namespace wav12 {
+
+    // Plays several Expanders at once. Each voice is decoded straight
+    // into one 32 bit stereo bus (Expander::expand2<true> adds to it),
+    // scaled by its volume, and the bus is clipped to 16 bits once, on
+    // the way out. The bus is the only buffer; longer output is mixed
+    // BUS_FRAMES at a time.
+    class Mixer
+    {
+    public:
+        static const int MAX_VOICES = 8;
+        static const int BUS_FRAMES = 256;
+        // VOLUME_UNITY is full scale. That leaves the bus room for
+        // MAX_VOICES at full scale (and twice that) without overflow.
+        static const int VOLUME_SHIFT = 12;
+        static const int32_t VOLUME_UNITY = 1 << VOLUME_SHIFT;
+
+        Mixer();
+
+        // Plays 'expander', which the caller owns, from where it is,
+        // and resampled if it has a step (Expander::setStep()).
+        // Returns the voice, or -1 if every voice is in use.
+        int play(Expander* expander, int32_t volume = VOLUME_UNITY);
+        void stop(int voice);
+        // The change is ramped over the next BUS_FRAMES of output,
+        // across as many calls to mix() as that takes.
+        void setVolume(int voice, int32_t volume);
+
+        // A voice stops by itself at the end of its stream, unless
+        // its Expander loops (Expander::setLoop()).
+        bool playing(int voice) const { return m_voices[voice].expander != 0; }
+        int numPlaying() const;
+
+        // Mixes nFrames interleaved left/right pairs to 'out'. Silence
+        // if nothing is playing.
+        void mix(int16_t* out, uint32_t nFrames);
+
+        static bool Test();
+
+    private:
+        struct Voice
+        {
+            Expander* expander;
+            int32_t volume;
+            int32_t target;     // of a ramp, or the volume
+            uint32_t rampLeft;  // frames to reach the target
+        };
+        Voice m_voices[MAX_VOICES];
+        int32_t m_bus[BUS_FRAMES * 2];
+    };
+}
+
+#endif // WAV12_MIXER_INCLUDED
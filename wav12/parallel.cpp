@@ -0,0 +1,123 @@
+#include "parallel.h"
+
+#include <atomic>
+#include <math.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+using namespace wav12;
+
+void wav12::parallelFor(int n, const std::function<void(int)>& func, int nThreads)
+{
+    if (nThreads <= 0)
+        nThreads = int(std::thread::hardware_concurrency());
+    nThreads = wMin(wMin(nThreads, n), 64);
+
+    if (nThreads <= 1) {
+        for (int i = 0; i < n; ++i)
+            func(i);
+        return;
+    }
+
+    std::atomic<int> next(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nThreads; ++t) {
+        threads.push_back(std::thread([&]() {
+            for (int i = next++; i < n; i = next++)
+                func(i);
+        }));
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+
+void wav12::linearExpandParallel(const Wav12Header& header, const uint8_t* compressed,
+    int16_t* data, int nThreads)
+{
+    if (header.format == 0 || !(header.flags & Wav12Header::FLAG_SEEK_TABLE)) {
+        linearExpand(header, compressed, data);
+        return;
+    }
+
+    // Runs of whole blocks, a few per thread to balance the load;
+    // each run seeks once and then decodes straight through.
+    if (nThreads <= 0)
+        nThreads = int(std::thread::hardware_concurrency());
+    const int nBlocks = int(header.nBlocks());
+    const int nRuns = wMin(nBlocks, wMax(nThreads, 1) * 4);
+
+    parallelFor(nRuns, [&](int run) {
+        uint32_t start = uint32_t(int64_t(nBlocks) * run / nRuns) << header.blockShift;
+        uint32_t end = uint32_t(int64_t(nBlocks) * (run + 1) / nRuns) << header.blockShift;
+        end = wMin(end, header.nSamples);
+
+        MemStream stream(compressed, header.lenInBytes);
+        Expander expander(&stream, header);
+        expander.seek(start);
+        expander.expand(data + start * header.channels(), end - start);
+    }, nThreads);
+}
+
+
+void wav12::linearCompressAuto(const int16_t* data, int32_t nSamples,
+    uint8_t** compressed, Wav12Header* header,
+    float minSNR,
+    CompressStat* stats,
+    int nThreads)
+{
+    static const int N = CompressStat::MAX_SHIFT + 1;
+    Wav12Header headers[N];
+    uint8_t* results[N] = { 0 };
+    CompressStat resultStats[N];
+
+    const int nValues = nSamples * header->channels();
+    double signal = 0;
+    for (int i = 0; i < nValues; ++i)
+        signal += double(data[i]) * data[i];
+
+    parallelFor(N, [&](int shift) {
+        headers[shift] = *header;
+        headers[shift].shiftBits = shift;
+        CompressStat& stat = resultStats[shift];
+        linearCompress(data, nSamples, &results[shift], &headers[shift], &stat);
+
+        int16_t* expanded = new int16_t[nValues];
+        linearExpand(headers[shift], results[shift], expanded);
+        double noise = 0;
+        for (int i = 0; i < nValues; ++i) {
+            int err = abs(data[i] - expanded[i]);
+            stat.maxError = wMax(stat.maxError, err);
+            noise += double(err) * err;
+        }
+        delete[] expanded;
+
+        stat.rmsError = nValues ? float(sqrt(noise / nValues)) : 0;
+        stat.snr = (noise > 0 && signal > 0) ? float(10.0 * log10(signal / noise)) : 0;
+    }, nThreads);
+
+    int best = 0;
+    for (int shift = 1; shift < N; ++shift) {
+        bool okay = resultStats[shift].maxError == 0 || resultStats[shift].snr >= minSNR;
+        if (okay && headers[shift].lenInBytes < headers[best].lenInBytes)
+            best = shift;
+    }
+
+    for (int shift = 0; shift < N; ++shift) {
+        if (shift != best)
+            delete[] results[shift];
+    }
+    *header = headers[best];
+    *compressed = results[best];
+
+    if (stats) {
+        *stats = resultStats[best];
+        stats->autoShift = true;
+        stats->minSNR = minSNR;
+        for (int shift = 0; shift < N; ++shift) {
+            stats->autoSize[shift] = headers[shift].lenInBytes;
+            stats->autoSNR[shift] = resultStats[shift].snr;
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef WAV12_PARALLEL_INCLUDED
+#define WAV12_PARALLEL_INCLUDED
+
+#include "compress.h"
+
+#include <functional>
+
+namespace wav12 {
+
+    // Calls func(i) for every i in [0, n), spread across nThreads
+    // (0 is one per core). For the tools; the codec itself is single
+    // threaded.
+    void parallelFor(int n, const std::function<void(int)>& func, int nThreads = 0);
+
+    // Compresses with every shiftBits in [0, CompressStat::MAX_SHIFT] in
+    // parallel, and keeps the smallest that has a signal to noise ratio
+    // of at least minSNR (dB). shiftBits 0 is lossless, and always
+    // qualifies. The header layout (flags, blockShift) is used as given.
+    // nThreads is as parallelFor; 1 when the caller is already parallel.
+    void linearCompressAuto(const int16_t* data, int32_t nSamples,
+        uint8_t** compressed, Wav12Header* header,
+        float minSNR,
+        CompressStat* stats = 0,
+        int nThreads = 0);
+
+    // Expands a stream written with FLAG_SEEK_TABLE. Every block starts
+    // from its seek entry, so the blocks are decoded in parallel. Other
+    // streams are expanded serially.
+    void linearExpandParallel(const Wav12Header& header, const uint8_t* compressed,
+        int16_t* data, int nThreads = 0);
+}
+
+#endif // WAV12_PARALLEL_INCLUDED
@@ -0,0 +1,204 @@
+#include "resample.h"
+#include "compress.h"
+
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WAV12_RESAMPLE_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define WAV12_RESAMPLE_NEON
+#include <arm_neon.h>
+#endif
+
+using namespace wav12;
+
+// Zero crossings of the sinc on each side, at the lower of the two rates.
+static const int ZERO_CROSSINGS = 16;
+// Cutoff, as a fraction of the lower Nyquist frequency.
+static const double ROLLOFF = 0.95;
+// About 85 dB of stop band.
+static const double KAISER_BETA = 8.0;
+// Taps are padded to a multiple of this, for the dot product.
+static const int TAP_ALIGN = 8;
+
+static int gcd(int a, int b)
+{
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Modified Bessel function of the first kind, order 0.
+static double besselI0(double x)
+{
+    double sum = 1;
+    double term = 1;
+    for (int k = 1; k < 50; ++k) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+// 'n' is a multiple of TAP_ALIGN.
+static inline float dot(const float* a, const float* b, int n)
+{
+#if defined(WAV12_RESAMPLE_SSE2)
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    for (int i = 0; i < n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    __m128 acc = _mm_add_ps(acc0, acc1);
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    return _mm_cvtss_f32(acc);
+#elif defined(WAV12_RESAMPLE_NEON)
+    float32x4_t acc0 = vdupq_n_f32(0);
+    float32x4_t acc1 = vdupq_n_f32(0);
+    for (int i = 0; i < n; i += 8) {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    float32x4_t acc = vaddq_f32(acc0, acc1);
+    float32x2_t sum = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    return vget_lane_f32(vpadd_f32(sum, sum), 0);
+#else
+    float sum = 0;
+    for (int i = 0; i < n; ++i)
+        sum += a[i] * b[i];
+    return sum;
+#endif
+}
+
+
+Resampler::Resampler(int inRate, int outRate, int channels)
+{
+    assert(inRate > 0 && outRate > 0);
+    int g = gcd(inRate, outRate);
+    m_channels = channels;
+    m_up = outRate / g;
+    m_down = inRate / g;
+
+    // The same rate is a copy (see process()), with no filter.
+    m_half = m_nTaps = 0;
+    if (m_up == m_down)
+        return;
+
+    double cutoff = ROLLOFF * wMin(1.0, double(m_up) / double(m_down));
+    m_half = int(ceil(ZERO_CROSSINGS / cutoff));
+    m_nTaps = (2 * m_half + TAP_ALIGN - 1) / TAP_ALIGN * TAP_ALIGN;
+    m_filter.assign(size_t(m_up) * m_nTaps, 0.0f);
+
+    const double PI = 3.14159265358979323846;
+    const double i0Beta = besselI0(KAISER_BETA);
+    for (int p = 0; p < m_up; ++p) {
+        float* h = &m_filter[size_t(p) * m_nTaps];
+        double frac = double(p) / m_up;
+        double sum = 0;
+        for (int k = 0; k < 2 * m_half; ++k) {
+            // Distance of the tap's input sample from the output sample.
+            double d = k - m_half + 1 - frac;
+            double t = d / m_half;
+            if (t <= -1 || t >= 1)
+                continue;
+            double x = PI * cutoff * d;
+            double sinc = x == 0 ? 1 : sin(x) / x;
+            double v = cutoff * sinc * besselI0(KAISER_BETA * sqrt(1 - t * t)) / i0Beta;
+            h[k] = float(v);
+            sum += v;
+        }
+        // Unity gain at DC for every phase.
+        for (int k = 0; k < 2 * m_half; ++k)
+            h[k] = float(h[k] / sum);
+    }
+}
+
+
+int Resampler::outputFrames(int nIn) const
+{
+    return int((int64_t(nIn) * m_up + m_down - 1) / m_down);
+}
+
+
+void Resampler::process(const int16_t* in, int nIn, int16_t* out) const
+{
+    if (m_up == m_down) {
+        memcpy(out, in, size_t(nIn) * m_channels * sizeof(int16_t));
+        return;
+    }
+    const int nOut = outputFrames(nIn);
+    // Zero padded, so the taps never run off either end.
+    std::vector<float> buf(size_t(nIn) + m_half + m_nTaps + 1, 0.0f);
+
+    for (int c = 0; c < m_channels; ++c) {
+        for (int i = 0; i < nIn; ++i)
+            buf[m_half + i] = in[i * m_channels + c];
+
+        for (int n = 0; n < nOut; ++n) {
+            int64_t pos = int64_t(n) * m_down;
+            int i = int(pos / m_up);
+            int p = int(pos % m_up);
+            // Tap k reads input i - m_half + 1 + k.
+            float v = dot(&m_filter[size_t(p) * m_nTaps], &buf[i + 1], m_nTaps);
+            v = floorf(v + 0.5f);
+            out[n * m_channels + c] = int16_t(wMax(-32768.0f, wMin(32767.0f, v)));
+        }
+    }
+}
+
+
+#define TEST_TRUE(x) \
+    if (!(x)) return false;
+
+// A sine through 'in' -> 'out', compared to the same sine at the
+// output rate, away from the ends.
+static bool testSine(int inRate, int outRate, double freq, int maxError)
+{
+    const double PI = 3.14159265358979323846;
+    const int N_IN = inRate / 10;
+    std::vector<int16_t> in(N_IN * 2);
+    for (int i = 0; i < N_IN; ++i) {
+        in[i * 2] = int16_t(10000 * sin(2 * PI * freq * i / inRate));
+        in[i * 2 + 1] = 0;
+    }
+    Resampler resampler(inRate, outRate, 2);
+    int nOut = resampler.outputFrames(N_IN);
+    TEST_TRUE(nOut == int((int64_t(N_IN) * outRate + inRate - 1) / inRate));
+    std::vector<int16_t> out(nOut * 2);
+    resampler.process(&in[0], N_IN, &out[0]);
+
+    for (int n = nOut / 4; n < nOut * 3 / 4; ++n) {
+        int expected = int(floor(10000 * sin(2 * PI * freq * n / outRate) + 0.5));
+        TEST_TRUE(abs(out[n * 2] - expected) <= maxError);
+        TEST_TRUE(out[n * 2 + 1] == 0);
+    }
+    return true;
+}
+
+/*static*/ bool Resampler::Test()
+{
+    {
+        // The same rate is a copy.
+        int16_t in[100];
+        int16_t out[100];
+        for (int i = 0; i < 100; ++i)
+            in[i] = int16_t(i * 331 - 16000);
+        Resampler resampler(22050, 22050, 1);
+        TEST_TRUE(resampler.outputFrames(100) == 100);
+        resampler.process(in, 100, out);
+        TEST_TRUE(memcmp(in, out, sizeof(in)) == 0);
+    }
+    TEST_TRUE(testSine(44100, 22050, 1000, 20));
+    TEST_TRUE(testSine(48000, 22050, 3000, 20));
+    TEST_TRUE(testSine(22050, 44100, 1000, 20));
+    TEST_TRUE(testSine(22050, 16000, 440, 20));
+    return true;
+}
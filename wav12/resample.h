@@ -0,0 +1,36 @@
+#ifndef WAV12_RESAMPLE_INCLUDED
+#define WAV12_RESAMPLE_INCLUDED
+
+#include <stdint.h>
+#include <vector>
+
+namespace wav12 {
+
+    // Sample rate conversion for the tools, with a polyphase windowed-sinc
+    // (Kaiser) filter. The rates are reduced to outRate / inRate = L / M;
+    // there are L phases of the filter, and every output sample is one
+    // dot product.
+    class Resampler
+    {
+    public:
+        Resampler(int inRate, int outRate, int channels);
+
+        // Frames out for nIn frames in.
+        int outputFrames(int nIn) const;
+
+        // Converts nIn interleaved frames to outputFrames(nIn) frames.
+        void process(const int16_t* in, int nIn, int16_t* out) const;
+
+        static bool Test();
+
+    private:
+        int m_channels;
+        int m_up;           // L
+        int m_down;         // M
+        int m_half;         // taps either side of the center
+        int m_nTaps;        // per phase, padded for the SIMD loop
+        std::vector<float> m_filter;    // m_up phases of m_nTaps
+    };
+}
+
+#endif // WAV12_RESAMPLE_INCLUDED
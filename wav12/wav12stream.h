@@ -9,6 +9,31 @@ namespace wav12 {
     public:
         virtual uint8_t get() = 0;
         virtual int16_t get16() = 0;
+
+        // Reads up to n bytes into dst. Returns the number of bytes
+        // read, which is only less than n at the end of the stream.
+        // The default goes through get(), and can't tell where the
+        // stream ends; streams should override it.
+        virtual int read(uint8_t* dst, int n) {
+            for (int i = 0; i < n; ++i)
+                dst[i] = get();
+            return n;
+        }
+
+        // Moves to byte 'pos' from the start of the stream. Returns
+        // false if the stream doesn't support random access.
+        virtual bool seek(uint32_t /*pos*/) { return false; }
+
+        // Streams backed by memory can return the rest of the stream
+        // (and its size), which is then read in place without calls
+        // through the stream. Returns null if not supported.
+        virtual const uint8_t* window(uint32_t* /*nBytes*/) { return 0; }
+    };
+
+    // Where streamed output goes, a buffer at a time.
+    class IOutStream {
+    public:
+        virtual void write(const uint8_t* src, int n) = 0;
     };
 
 }
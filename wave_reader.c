@@ -7,8 +7,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 #include "wave_reader.h"
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WR_SSE2
+#include <emmintrin.h>
+#endif
+
 #define FOUR_CC(a,b,c,d) (((a)<<24) | ((b)<<16) | ((c)<<8) | ((d)<<0))
 
 struct wave_reader {
@@ -17,155 +33,234 @@ struct wave_reader {
     int sample_rate;
     int sample_bits;
     int num_samples;
-    FILE *fp;
+    unsigned int dither_state;
+    unsigned char *file;        /* the whole file, mapped or read */
+    long file_len;
+    int mapped;
+    const unsigned char *data;  /* the data chunk, in 'file' */
+    long data_len;
+    long pos;                   /* bytes of 'data' read */
+    int has_loop;
+    int loop_start;             /* frames; the end is exclusive */
+    int loop_end;
 };
 
 static int
-read_byte(FILE *fp, unsigned char *out)
-{
-    if (1 > fread(out, 1, 1, fp)) {
-        return feof(fp) ? 0 : -1;
-    }
-    return 1;
-}
-
-static int
-read_int32_b(FILE *fp, int *out)
+get_int32_b(const unsigned char *p)
 {
-    int result;
-    unsigned char a, b, c, d;
-
-    if ((result=read_byte(fp, &a)) != 1) return result;
-    if ((result=read_byte(fp, &b)) != 1) return result;
-    if ((result=read_byte(fp, &c)) != 1) return result;
-    if ((result=read_byte(fp, &d)) != 1) return result;
-
-    *out = (a<<24) | (b<<16) | (c<<8) | (d<<0);
-    return 1;
+    return (p[0]<<24) | (p[1]<<16) | (p[2]<<8) | (p[3]<<0);
 }
 
 static int
-read_int32_l(FILE *fp, int *out)
+get_int32_l(const unsigned char *p)
 {
-    int result;
-    unsigned char a, b, c, d;
-
-    if ((result=read_byte(fp, &a)) != 1) return result;
-    if ((result=read_byte(fp, &b)) != 1) return result;
-    if ((result=read_byte(fp, &c)) != 1) return result;
-    if ((result=read_byte(fp, &d)) != 1) return result;
-
-    *out = (d<<24) | (c<<16) | (b<<8) | (a<<0);
-    return 1;
+    return (p[3]<<24) | (p[2]<<16) | (p[1]<<8) | (p[0]<<0);
 }
 
 static int
-read_int16_l(FILE *fp, int *out)
+get_int16_l(const unsigned char *p)
 {
-    int result;
-    unsigned char a, b;
-
-    if ((result=read_byte(fp, &a)) != 1) return result;
-    if ((result=read_byte(fp, &b)) != 1) return result;
-
-    *out = (b<<8) | (a<<0);
-    return 1;
+    return (p[1]<<8) | (p[0]<<0);
 }
 
 static int
-read_wave_chunk(struct wave_reader *wr, wave_reader_error *error)
+read_fmt_chunk(struct wave_reader *wr, const unsigned char *p, long len)
 {
-    int result;
-    int sub1_id, sub1_len, sub2_id, sub2_len, byte_rate, block_align;
-
-    if ((result=read_int32_b(wr->fp, &sub1_id)) != 1) {
-        *error = result == 0 ? WR_BAD_CONTENT : WR_IO_ERROR;
+    if (len < 16) {
         return 0;
     }
-
-    if (sub1_id != FOUR_CC('f','m','t',' ')) {
-        *error = WR_BAD_CONTENT;
-        return 0;
+    wr->format = get_int16_l(p);
+    wr->num_channels = get_int16_l(p + 2);
+    wr->sample_rate = get_int32_l(p + 4);
+    /* byte rate and block align are derived */
+    wr->sample_bits = get_int16_l(p + 14);
+
+    /* WAVE_FORMAT_EXTENSIBLE: the real format is the start of the sub-format GUID,
+     * after cbSize, valid bits and the channel mask. */
+    if (wr->format == WR_FORMAT_EXTENSIBLE && len >= 40) {
+        wr->format = get_int16_l(p + 24);
     }
+    return wr->num_channels > 0 && wr->sample_bits >= 8;
+}
 
-    if ((result=read_int32_l(wr->fp, &sub1_len)) != 1) {
-        *error = result == 0 ? WR_BAD_CONTENT : WR_IO_ERROR;
-        return 0;
+/* The first loop of a sampler chunk. Its end is the last frame played,
+ * which is kept as the frame after. */
+static void
+read_smpl_chunk(struct wave_reader *wr, const unsigned char *p, long len)
+{
+    if (len < 36 + 24 || get_int32_l(p + 28) < 1) {
+        return;
     }
+    wr->has_loop = 1;
+    wr->loop_start = get_int32_l(p + 36 + 8);
+    wr->loop_end = get_int32_l(p + 36 + 12) + 1;
+}
 
-    if ((result=read_int16_l(wr->fp, &wr->format)) != 1) {
-        *error = result == 0 ? WR_BAD_CONTENT : WR_IO_ERROR;
+/* Walks every chunk of the RIFF WAVE form; unknown ones are skipped. */
+static int
+read_wave_chunks(struct wave_reader *wr, long file_len, wave_reader_error *error)
+{
+    const unsigned char *p = wr->file;
+    const unsigned char *end = wr->file + file_len;
+    int have_fmt = 0;
+
+    if (file_len < 12
+        || get_int32_b(p) != FOUR_CC('R','I','F','F')
+        || get_int32_b(p + 8) != FOUR_CC('W','A','V','E'))
+    {
+        *error = WR_BAD_CONTENT;
         return 0;
     }
 
-    if ((result=read_int16_l(wr->fp, &wr->num_channels)) != 1) {
-        *error = result == 0 ? WR_BAD_CONTENT : WR_IO_ERROR;
-        return 0;
-    }
+    for (p += 12; end - p >= 8; ) {
+        int id = get_int32_b(p);
+        /* Unsigned: streamed files can leave 0xffffffff for 'unknown'. */
+        unsigned long len = (unsigned int)get_int32_l(p + 4);
+        unsigned long left;
+        int truncated;
+
+        p += 8;
+        left = (unsigned long)(end - p);
+        truncated = len > left;
+        if (truncated) {
+            len = left;
+        }
 
-    if ((result=read_int32_l(wr->fp, &wr->sample_rate)) != 1) {
-        *error = result == 0 ? WR_BAD_CONTENT : WR_IO_ERROR;
-        return 0;
+        switch (id) {
+        case FOUR_CC('f','m','t',' '):
+            if (truncated || !read_fmt_chunk(wr, p, (long)len)) {
+                *error = WR_BAD_CONTENT;
+                return 0;
+            }
+            have_fmt = 1;
+            break;
+        case FOUR_CC('d','a','t','a'):
+            /* A truncated file keeps the samples it has. */
+            wr->data = p;
+            wr->data_len = (long)len;
+            break;
+        case FOUR_CC('s','m','p','l'):
+            read_smpl_chunk(wr, p, (long)len);
+            break;
+        }
+        /* A chunk that runs to (or past) the end is the last. */
+        if (len == left) {
+            break;
+        }
+        /* Chunks are padded to an even length. */
+        p += len + (len & 1);
     }
 
-    if ((result=read_int32_l(wr->fp, &byte_rate)) != 1) {
-        *error = result == 0 ? WR_BAD_CONTENT : WR_IO_ERROR;
+    if (!have_fmt || !wr->data) {
+        *error = WR_BAD_CONTENT;
         return 0;
     }
-
-    if ((result=read_int16_l(wr->fp, &block_align)) != 1) {
-        *error = result == 0 ? WR_BAD_CONTENT : WR_IO_ERROR;
-        return 0;
+    wr->num_samples = (int)(wr->data_len / (wr->num_channels * wr->sample_bits / 8));
+    /* A loop that isn't inside the samples isn't used. */
+    if (wr->loop_start < 0 || wr->loop_start >= wr->loop_end || wr->loop_end > wr->num_samples) {
+        wr->has_loop = 0;
     }
+    return 1;
+}
 
-    if ((result=read_int16_l(wr->fp, &wr->sample_bits)) != 1) {
-        *error = result == 0 ? WR_BAD_CONTENT : WR_IO_ERROR;
-        return 0;
+/* Maps the file read only. NULL if it can't be mapped (or is empty). */
+static unsigned char *
+map_file(const char *filename, long *len)
+{
+    void *p = NULL;
+#if defined(_WIN32)
+    HANDLE file, mapping;
+    LARGE_INTEGER size;
+
+    file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return NULL;
     }
-
-    if ((result=read_int32_b(wr->fp, &sub2_id)) != 1) {
-        *error = result == 0 ? WR_BAD_CONTENT : WR_IO_ERROR;
-        return 0;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0 && size.QuadPart < 0x7fffffff) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            /* The view keeps the mapping alive. */
+            p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+            *len = (long)size.QuadPart;
+        }
     }
+    CloseHandle(file);
+#else
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
 
-    if (sub2_id != FOUR_CC('d','a','t','a')) {
-        *error = WR_BAD_CONTENT;
-        return 0;
+    if (fd < 0) {
+        return NULL;
     }
-
-    if ((result=read_int32_l(wr->fp, &sub2_len)) != 1) {
-        *error = result == 0 ? WR_BAD_CONTENT : WR_IO_ERROR;
-        return 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size < 0x7fffffff) {
+        p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            p = NULL;
+        } else {
+            madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+            *len = (long)st.st_size;
+        }
     }
-
-    wr->num_samples = sub2_len / (wr->num_channels * wr->sample_bits / 8);
-
-    return 1;
+    close(fd);
+#endif
+    return (unsigned char *)p;
 }
 
+/* Reads the whole file with one fread, where it can't be mapped. */
 static int
-skip(struct wave_reader *wr, wave_reader_error *error)
+read_file(struct wave_reader *wr, const char *filename, wave_reader_error *error)
 {
-    int len;
+    FILE *fp = fopen(filename, "rb");
 
-    if (!read_int32_l(wr->fp, &len)) {
-        *error = WR_IO_ERROR;
+    if (!fp) {
+        *error = WR_OPEN_ERROR;
         return 0;
     }
-
-    if (fseek(wr->fp, len, SEEK_CUR) == -1) {
+    if (fseek(fp, 0, SEEK_END) != 0 || (wr->file_len = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0) {
         *error = WR_IO_ERROR;
-        return 0;
+        goto reading_error;
     }
-
+    wr->file = (unsigned char *)malloc(wr->file_len > 0 ? wr->file_len : 1);
+    if (!wr->file) {
+        *error = WR_ALLOC_ERROR;
+        goto reading_error;
+    }
+    if (fread(wr->file, 1, wr->file_len, fp) != (size_t)wr->file_len) {
+        *error = WR_IO_ERROR;
+        goto reading_error;
+    }
+    fclose(fp);
     return 1;
+
+reading_error:
+    free(wr->file);
+    wr->file = NULL;
+    fclose(fp);
+    return 0;
+}
+
+static void
+release_file(struct wave_reader *wr)
+{
+    if (!wr->mapped) {
+        free(wr->file);
+    }
+#if defined(_WIN32)
+    else {
+        UnmapViewOfFile(wr->file);
+    }
+#else
+    else {
+        munmap(wr->file, (size_t)wr->file_len);
+    }
+#endif
 }
 
 struct wave_reader *
 wave_reader_open(const char *filename, wave_reader_error *error)
 {
-    int root_id, root_len, format_id;
-    int continue_reading = 1;
     struct wave_reader *wr = NULL;
 
     assert(filename != NULL);
@@ -177,51 +272,23 @@ wave_reader_open(const char *filename, wave_reader_error *error)
         goto alloc_error;
     }
 
-    wr->fp = fopen(filename, "rb");
-    if (!wr->fp) {
-        *error = WR_OPEN_ERROR;
+    wr->dither_state = 0x2545f491;
+    /* The samples are used from the file image in place, so a mapped
+     * file is only paged in as it is read. */
+    wr->file = map_file(filename, &wr->file_len);
+    if (wr->file) {
+        wr->mapped = 1;
+    } else if (!read_file(wr, filename, error)) {
         goto open_error;
     }
 
-    if (!read_int32_b(wr->fp, &root_id)) {
-        *error = WR_IO_ERROR;
-        goto reading_error;
-    }
-
-    if (root_id != FOUR_CC('R','I','F','F')) {
-        *error = WR_BAD_CONTENT;
-        goto reading_error;
-    }
-
-    if (!read_int32_l(wr->fp, &root_len)) {
-        *error = WR_IO_ERROR;
-        goto reading_error;
-    }
-
-    while (continue_reading) {
-        if (!read_int32_b(wr->fp, &format_id)) {
-            *error = WR_IO_ERROR;
-            goto reading_error;
-        }
-
-        switch (format_id) {
-        case FOUR_CC('W','A','V','E'):
-            if (!read_wave_chunk(wr, error)) {
-                goto reading_error;
-            }
-            continue_reading = 0;
-            break;
-        default:
-            if (!skip(wr, error)) {
-                goto reading_error;
-            }
-        }
+    if (!read_wave_chunks(wr, wr->file_len, error)) {
+        goto content_error;
     }
-
     return wr;
 
-reading_error:
-    fclose(wr->fp);
+content_error:
+    release_file(wr);
 open_error:
     free(wr);
 alloc_error:
@@ -233,7 +300,7 @@ void
 wave_reader_close(struct wave_reader *wr)
 {
     if (wr) {
-        fclose(wr->fp);
+        release_file(wr);
         free(wr);
     }
 }
@@ -281,16 +348,183 @@ wave_reader_get_num_samples(struct wave_reader *wr)
 int
 wave_reader_get_samples(struct wave_reader *wr, int n, void *buf)
 {
-    int ret;
+    int frame;
+    long left;
 
     assert(wr != NULL);
     assert(buf != NULL);
 
-    ret = fread(buf, wr->num_channels * wr->sample_bits / 8, n, wr->fp);
-    if (ret < n && ferror(wr->fp)) {
-        return -1;
+    frame = wr->num_channels * wr->sample_bits / 8;
+    left = (wr->data_len - wr->pos) / frame;
+    if (n > left) {
+        n = (int)left;
+    }
+    memcpy(buf, wr->data + wr->pos, (size_t)n * frame);
+    wr->pos += (long)n * frame;
+
+    return n;
+}
+
+int
+wave_reader_get_loop(struct wave_reader *wr, int *start, int *end)
+{
+    assert(wr != NULL);
+
+    if (!wr->has_loop) {
+        return 0;
+    }
+    *start = wr->loop_start;
+    *end = wr->loop_end;
+    return 1;
+}
+
+const short *
+wave_reader_get_int16_data(struct wave_reader *wr)
+{
+    assert(wr != NULL);
+
+    if (wr->format != WR_FORMAT_PCM || wr->sample_bits != 16) {
+        return NULL;
+    }
+    return (const short *)wr->data;
+}
+
+int
+wave_reader_is_supported(struct wave_reader *wr)
+{
+    assert(wr != NULL);
+
+    if (wr->format == WR_FORMAT_PCM) {
+        return wr->sample_bits == 8 || wr->sample_bits == 16
+            || wr->sample_bits == 24 || wr->sample_bits == 32;
+    }
+    if (wr->format == WR_FORMAT_FLOAT) {
+        return wr->sample_bits == 32 || wr->sample_bits == 64;
+    }
+    return 0;
+}
+
+#define CONVERT_CHUNK 1024
+
+/* TPDF noise: the sum of two uniform values, in [-65535, 65535] 1/65536ths of a 16 bit step. */
+static int
+tpdf_noise(struct wave_reader *wr)
+{
+    unsigned int x = wr->dither_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    wr->dither_state = x;
+    return (int)(x & 0xffff) + (int)(x >> 16) - 65535;
+}
+
+/* 'in' has 24 bits; 256 is one 16 bit step. 'bias' is the rounding, plus the dither. */
+static void
+convert_int24(const int *in, const int *bias, int n, short *out)
+{
+    int i = 0;
+#ifdef WR_SSE2
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(in + i)), _mm_loadu_si128((const __m128i*)(bias + i)));
+        __m128i b = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(in + i + 4)), _mm_loadu_si128((const __m128i*)(bias + i + 4)));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(_mm_srai_epi32(a, 8), _mm_srai_epi32(b, 8)));
+    }
+#endif
+    for (; i < n; ++i) {
+        int v = (in[i] + bias[i]) >> 8;
+        out[i] = (short)(v < -32768 ? -32768 : v > 32767 ? 32767 : v);
     }
+}
 
-    return ret;
+/* 'in' is [-1, 1); 'bias' is the dither, in 16 bit steps. */
+static void
+convert_float(const float *in, const float *bias, int n, short *out)
+{
+    int i = 0;
+#ifdef WR_SSE2
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 lo = _mm_set1_ps(-32768.0f);
+    const __m128 hi = _mm_set1_ps(32767.0f);
+    for (; i + 8 <= n; i += 8) {
+        __m128 a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i), scale), _mm_loadu_ps(bias + i));
+        __m128 b = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i + 4), scale), _mm_loadu_ps(bias + i + 4));
+        /* NaN goes to lo, as below. */
+        a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+        b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+    }
+#endif
+    for (; i < n; ++i) {
+        float v = in[i] * 32768.0f + bias[i];
+        if (!(v > -32768.0f)) v = -32768.0f;
+        if (v > 32767.0f) v = 32767.0f;
+        out[i] = (short)lrintf(v);
+    }
 }
 
+int
+wave_reader_get_samples_int16(struct wave_reader *wr, int n, short *buf, int dither)
+{
+    const unsigned char *raw;
+    int ints[CONVERT_CHUNK];
+    int bias[CONVERT_CHUNK];
+    float floats[CONVERT_CHUNK];
+    float float_bias[CONVERT_CHUNK];
+    int bytes, total, done, count, got, i;
+
+    assert(wr != NULL);
+    assert(buf != NULL);
+
+    if (!wave_reader_is_supported(wr)) {
+        return -1;
+    }
+    if (wr->format == WR_FORMAT_PCM && wr->sample_bits == 16) {
+        return wave_reader_get_samples(wr, n, buf);
+    }
+
+    bytes = wr->sample_bits / 8;
+    total = n * wr->num_channels;
+    for (done = 0; done < total; done += got) {
+        count = total - done < CONVERT_CHUNK ? total - done : CONVERT_CHUNK;
+        raw = wr->data + wr->pos;
+        got = (int)((wr->data_len - wr->pos) / bytes);
+        if (got > count) {
+            got = count;
+        }
+        wr->pos += (long)got * bytes;
+
+        if (wr->format == WR_FORMAT_FLOAT) {
+            if (bytes == 4) {
+                memcpy(floats, raw, got * 4);
+            } else {
+                for (i = 0; i < got; ++i) {
+                    double d;
+                    memcpy(&d, raw + i * 8, 8);
+                    floats[i] = (float)d;
+                }
+            }
+            for (i = 0; i < got; ++i) {
+                float_bias[i] = dither ? (float)tpdf_noise(wr) * (1.0f / 65536.0f) : 0.0f;
+            }
+            convert_float(floats, float_bias, got, buf + done);
+        } else if (bytes == 1) {
+            for (i = 0; i < got; ++i) {
+                buf[done + i] = (short)((raw[i] - 128) << 8);
+            }
+        } else {
+            for (i = 0; i < got; ++i) {
+                const unsigned char *p = raw + i * bytes;
+                /* The top 24 bits, sign extended. */
+                ints[i] = (int)(((unsigned int)p[bytes - 3] << 8) | ((unsigned int)p[bytes - 2] << 16)
+                    | ((unsigned int)p[bytes - 1] << 24)) >> 8;
+                bias[i] = 128 + (dither ? tpdf_noise(wr) >> 8 : 0);
+            }
+            convert_int24(ints, bias, got, buf + done);
+        }
+        if (got < count) {
+            done += got;
+            break;
+        }
+    }
+    return done / wr->num_channels;
+}
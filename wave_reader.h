@@ -9,6 +9,12 @@ typedef enum {
     WR_BAD_CONTENT,
 } wave_reader_error;
 
+typedef enum {
+    WR_FORMAT_PCM = 1,
+    WR_FORMAT_FLOAT = 3,
+    WR_FORMAT_EXTENSIBLE = 0xfffe,  /* resolved to the sub-format when opened */
+} wave_reader_format;
+
 typedef struct wave_reader wave_reader;
 
 wave_reader *wave_reader_open(const char *filename, wave_reader_error *error);
@@ -20,5 +26,18 @@ int wave_reader_get_sample_bits(wave_reader *wr);
 int wave_reader_get_num_samples(wave_reader *wr);
 int wave_reader_get_samples(wave_reader *wr, int n, void *buf);
 
+/* 8, 16, 24 or 32 bit PCM, or 32 or 64 bit float. */
+int wave_reader_is_supported(wave_reader *wr);
+/* Reads n frames as 16 bit, from any supported format. With 'dither',
+ * samples with more than 16 bits get TPDF dither instead of rounding.
+ * Returns the frames read, or -1. */
+int wave_reader_get_samples_int16(wave_reader *wr, int n, short *buf, int dither);
+/* All the samples, in place, if the file is 16 bit PCM; else NULL.
+ * Valid until the reader is closed. */
+const short *wave_reader_get_int16_data(wave_reader *wr);
+/* The first loop of the 'smpl' chunk, in frames: from start up to (not
+ * including) end. Returns 0, and leaves them, if there isn't one. */
+int wave_reader_get_loop(wave_reader *wr, int *start, int *end);
+
 #endif//WAVE_READER_H
 